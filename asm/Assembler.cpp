@@ -0,0 +1,722 @@
+#include "Assembler.h"
+#include "LC3.h"
+#include "Specifics.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+namespace fs = std::filesystem;
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace {
+
+// bump allocator for one file's symbols and fixups, all freed together
+class Arena {
+public:
+  template <typename T> auto make() -> T * {
+    static_assert(std::is_trivially_destructible_v<T>, "arena objects are never destroyed");
+    size_t at = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+    if (blocks.empty() || at + sizeof(T) > block_size) {
+      blocks.emplace_back(new std::byte[block_size]);
+      at = 0;
+    }
+    used = at + sizeof(T);
+    return new (blocks.back().get() + at) T{};
+  }
+
+private:
+  static constexpr size_t block_size = 1 << 14;
+
+  vector<std::unique_ptr<std::byte[]>> blocks;
+  size_t used = 0;
+};
+
+// a use of a label not defined yet: the word at `index` gets its address,
+// or its offset in the low `bits` bits
+struct Fixup {
+  uint32_t index;
+  int bits; // 16: the address itself (.FILL)
+  int line;
+  Fixup *next;
+};
+
+struct Symbol {
+  string_view name; // points into the source
+  uint64_t hash;
+  uint16_t address;
+  bool defined;
+  int line;
+  Fixup *pending; // uses waiting for the definition
+};
+
+auto hash_of(string_view name) -> uint64_t {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (char c : name)
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+  return hash;
+}
+
+// open addressing over arena-allocated symbols, kept at most half full
+class SymbolTable {
+public:
+  explicit SymbolTable(Arena &arena) : arena(arena), slots(64) {}
+
+  auto find_or_add(string_view name) -> Symbol * {
+    if (2 * (count + 1) > slots.size())
+      grow();
+    uint64_t hash = hash_of(name);
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      Symbol *s = slots[i];
+      if (!s) {
+        s = slots[i] = arena.make<Symbol>();
+        s->name = name;
+        s->hash = hash;
+        ++count;
+        return s;
+      }
+      if (s->hash == hash && s->name == name)
+        return s;
+    }
+  }
+
+  template <typename F> auto each(F f) const -> void {
+    for (Symbol *s : slots)
+      if (s)
+        f(*s);
+  }
+
+private:
+  auto grow() -> void {
+    vector<Symbol *> old(2 * slots.size());
+    old.swap(slots);
+    size_t mask = slots.size() - 1;
+    for (Symbol *s : old) {
+      if (!s)
+        continue;
+      size_t i = s->hash & mask;
+      while (slots[i])
+        i = (i + 1) & mask;
+      slots[i] = s;
+    }
+  }
+
+  Arena &arena;
+  vector<Symbol *> slots;
+  size_t count = 0;
+};
+
+enum class Form {
+  Arith,      // ADD, AND: DR, SR1, SR2 or imm5
+  Not,        // DR, SR
+  Branch,     // PCoffset9
+  Base,       // JMP, JSRR: BaseR
+  Call,       // JSR: PCoffset11
+  Relative,   // LD, LDI, LEA, ST, STI: R, PCoffset9
+  BaseOffset, // LDR, STR: R, BaseR, offset6
+  Fixed,      // RET, RTI and the TRAP aliases
+  Trap,       // trapvect8
+  Orig,
+  End,
+  Fill,
+  Blkw,
+  Stringz,
+};
+
+struct Mnemonic {
+  string_view name;
+  Form form;
+  uint16_t bits;
+  int operands;
+};
+
+constexpr auto op(uint16_t opcode) -> uint16_t { return opcode << 12; }
+
+constexpr Mnemonic mnemonics[] = {
+    {"ADD", Form::Arith, op(Opcodes::OP_ADD), 3},
+    {"AND", Form::Arith, op(Opcodes::OP_AND), 3},
+    {"NOT", Form::Not, op(Opcodes::OP_NOT) | 0x3f, 2},
+    {"BR", Form::Branch, 0x0e00, 1},
+    {"BRN", Form::Branch, 0x0800, 1},
+    {"BRZ", Form::Branch, 0x0400, 1},
+    {"BRP", Form::Branch, 0x0200, 1},
+    {"BRNZ", Form::Branch, 0x0c00, 1},
+    {"BRNP", Form::Branch, 0x0a00, 1},
+    {"BRZP", Form::Branch, 0x0600, 1},
+    {"BRNZP", Form::Branch, 0x0e00, 1},
+    {"JMP", Form::Base, op(Opcodes::OP_JMP), 1},
+    {"RET", Form::Fixed, op(Opcodes::OP_JMP) | 7 << 6, 0},
+    {"JSR", Form::Call, op(Opcodes::OP_JSR) | 1 << 11, 1},
+    {"JSRR", Form::Base, op(Opcodes::OP_JSR), 1},
+    {"LD", Form::Relative, op(Opcodes::OP_LD), 2},
+    {"LDI", Form::Relative, op(Opcodes::OP_LDI), 2},
+    {"LEA", Form::Relative, op(Opcodes::OP_LEA), 2},
+    {"ST", Form::Relative, op(Opcodes::OP_ST), 2},
+    {"STI", Form::Relative, op(Opcodes::OP_STI), 2},
+    {"LDR", Form::BaseOffset, op(Opcodes::OP_LDR), 3},
+    {"STR", Form::BaseOffset, op(Opcodes::OP_STR), 3},
+    {"RTI", Form::Fixed, op(Opcodes::OP_RTI), 0},
+    {"TRAP", Form::Trap, op(Opcodes::OP_TRAP), 1},
+    {"GETC", Form::Fixed, op(Opcodes::OP_TRAP) | TrapCodes::TRAP_GETC, 0},
+    {"OUT", Form::Fixed, op(Opcodes::OP_TRAP) | TrapCodes::TRAP_OUT, 0},
+    {"PUTS", Form::Fixed, op(Opcodes::OP_TRAP) | TrapCodes::TRAP_PUTS, 0},
+    {"IN", Form::Fixed, op(Opcodes::OP_TRAP) | TrapCodes::TRAP_IN, 0},
+    {"PUTSP", Form::Fixed, op(Opcodes::OP_TRAP) | TrapCodes::TRAP_PUTSP, 0},
+    {"HALT", Form::Fixed, op(Opcodes::OP_TRAP) | TrapCodes::TRAP_HALT, 0},
+    {".ORIG", Form::Orig, 0, 1},
+    {".END", Form::End, 0, 0},
+    {".FILL", Form::Fill, 0, 1},
+    {".BLKW", Form::Blkw, 0, 1},
+    {".STRINGZ", Form::Stringz, 0, 1},
+};
+
+// opcodes and pseudo-ops are case-insensitive
+auto find_mnemonic(string_view token) -> const Mnemonic * {
+  char upper[10];
+  if (token.empty() || token.size() >= sizeof upper)
+    return nullptr;
+  for (size_t i = 0; i < token.size(); ++i)
+    upper[i] = static_cast<char>(token[i] >= 'a' && token[i] <= 'z' ? token[i] - 32 : token[i]);
+  string_view name(upper, token.size());
+  for (const auto &m : mnemonics)
+    if (m.name[0] == name[0] && name == m.name)
+      return &m;
+  return nullptr;
+}
+
+auto is_space(char c) -> bool { return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v'; }
+
+auto is_identifier(string_view s) -> bool {
+  auto alpha = [](char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; };
+  if (s.empty() || !alpha(s[0]))
+    return false;
+  return std::all_of(s.begin() + 1, s.end(), [&](char c) { return alpha(c) || (c >= '0' && c <= '9'); });
+}
+
+// R0-R7, or -1
+auto register_of(string_view s) -> int {
+  if (s.size() == 2 && (s[0] == 'R' || s[0] == 'r') && s[1] >= '0' && s[1] <= '7')
+    return s[1] - '0';
+  return -1;
+}
+
+// #decimal, xhex or a plain decimal, each with an optional sign
+auto number_of(string_view s, int32_t &value) -> bool {
+  int base = 10;
+  size_t i = 0;
+  if (!s.empty() && s[0] == '#') {
+    i = 1;
+  } else if (!s.empty() && (s[0] == 'x' || s[0] == 'X')) {
+    base = 16;
+    i = 1;
+  } else if (s.empty() || !((s[0] >= '0' && s[0] <= '9') || s[0] == '-' || s[0] == '+')) {
+    return false;
+  }
+  bool negative = i < s.size() && s[i] == '-';
+  if (i < s.size() && (s[i] == '-' || s[i] == '+'))
+    ++i;
+  if (i == s.size())
+    return false;
+
+  int32_t v = 0;
+  for (; i < s.size(); ++i) {
+    char c = s[i];
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                       : base;
+    if (digit >= base)
+      return false;
+    v = std::min(v * base + digit, 0x100000); // out of range either way
+  }
+  value = negative ? -v : v;
+  return true;
+}
+
+auto fits(int32_t value, int bits) -> bool {
+  return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+}
+
+auto quoted(string_view s) -> string {
+  string q(1, '\'');
+  q.append(s);
+  q.push_back('\'');
+  return q;
+}
+
+class Assembler {
+public:
+  Assembler(const char *source, size_t size) : source(source, size), symbols(arena) {}
+
+  auto run() -> Assembly;
+
+private:
+  static constexpr int max_tokens = 5; // label, mnemonic, three operands
+
+  auto statement(string_view line) -> void;
+  auto split(string_view line, string_view *tokens) -> int;
+  auto instruction(const Mnemonic &m, const string_view *args) -> void;
+  auto define(string_view label) -> void;
+  auto patch(const Fixup &fixup, uint16_t address) -> void;
+  auto offset(string_view arg, int bits) -> uint16_t;
+  auto reg(string_view arg) -> uint16_t;
+  auto immediate(string_view arg, int32_t low, int32_t high) -> int32_t;
+  auto string_literal(string_view arg) -> void;
+  auto emit(uint16_t word) -> void;
+  auto here() const -> uint16_t { return static_cast<uint16_t>(out.origin + out.words.size()); }
+  auto started() -> bool;
+  auto error(string message) -> void { error_at(line_number, std::move(message)); }
+  auto error_at(int line, string message) -> void { out.errors.push_back({line, std::move(message)}); }
+
+  string_view source;
+  Arena arena;
+  SymbolTable symbols;
+  Assembly out;
+  int line_number = 0;
+  bool has_origin = false;
+  bool missing_origin = false; // reported
+  bool ended = false;
+  bool full = false; // the program reached xFFFF
+};
+
+auto Assembler::run() -> Assembly {
+  for (size_t at = 0; at < source.size() && !ended;) {
+    size_t end = source.find('\n', at);
+    if (end == string_view::npos)
+      end = source.size();
+    ++line_number;
+    statement(source.substr(at, end - at));
+    at = end + 1;
+  }
+  if (!has_origin)
+    started();
+
+  symbols.each([this](const Symbol &s) {
+    for (const Fixup *f = s.pending; f; f = f->next)
+      error_at(f->line, "undefined label " + quoted(s.name));
+  });
+  std::stable_sort(out.errors.begin(), out.errors.end(),
+                   [](const AssemblyError &a, const AssemblyError &b) { return a.line < b.line; });
+  return std::move(out);
+}
+
+// tokens are separated by blanks and commas; a quoted string is one token
+// and a ';' outside one starts a comment. -1 on an error
+auto Assembler::split(string_view line, string_view *tokens) -> int {
+  int count = 0;
+  for (size_t i = 0; i < line.size();) {
+    char c = line[i];
+    if (c == ';')
+      break;
+    if (is_space(c) || c == ',') {
+      ++i;
+      continue;
+    }
+
+    size_t start = i;
+    if (c == '"') {
+      for (++i; i < line.size() && line[i] != '"'; ++i)
+        if (line[i] == '\\')
+          ++i;
+      if (i >= line.size()) {
+        error("unterminated string");
+        return -1;
+      }
+      ++i;
+    } else {
+      while (i < line.size() && !is_space(line[i]) && line[i] != ',' && line[i] != ';' &&
+             line[i] != '"')
+        ++i;
+    }
+    if (count == max_tokens) {
+      error("too many operands");
+      return -1;
+    }
+    tokens[count++] = line.substr(start, i - start);
+  }
+  return count;
+}
+
+auto Assembler::statement(string_view line) -> void {
+  string_view tokens[max_tokens];
+  int count = split(line, tokens);
+  if (count <= 0)
+    return;
+
+  int first = 0;
+  const Mnemonic *m = find_mnemonic(tokens[0]);
+  if (!m) {
+    string_view label = tokens[0];
+    if (label.back() == ':')
+      label.remove_suffix(1);
+    if (!is_identifier(label) || register_of(label) >= 0) {
+      error("unknown instruction " + quoted(tokens[0]));
+      return;
+    }
+    if (!started())
+      return;
+    define(label);
+    if (count == 1)
+      return;
+    first = 1;
+    if (!(m = find_mnemonic(tokens[1]))) {
+      // more likely a misspelled instruction than a label
+      error("unknown instruction " + quoted(tokens[0]));
+      return;
+    }
+  }
+
+  int operands = count - first - 1;
+  if (operands != m->operands) {
+    error(string(m->name) + " takes " + std::to_string(m->operands) +
+          (m->operands == 1 ? " operand" : " operands"));
+    return;
+  }
+  if (m->form != Form::Orig && !started())
+    return;
+  instruction(*m, tokens + first + 1);
+}
+
+// everything but .ORIG needs an origin; a missing one is reported once
+auto Assembler::started() -> bool {
+  if (!has_origin && !missing_origin) {
+    error("expected .ORIG");
+    missing_origin = true;
+  }
+  return has_origin;
+}
+
+auto Assembler::instruction(const Mnemonic &m, const string_view *args) -> void {
+  uint16_t word = m.bits;
+  switch (m.form) {
+  case Form::Arith:
+    word |= reg(args[0]) << 9 | reg(args[1]) << 6;
+    if (register_of(args[2]) >= 0)
+      word |= reg(args[2]);
+    else
+      word |= 0x20 | (immediate(args[2], -16, 15) & 0x1f);
+    break;
+  case Form::Not:
+    word |= reg(args[0]) << 9 | reg(args[1]) << 6;
+    break;
+  case Form::Branch:
+    word |= offset(args[0], 9);
+    break;
+  case Form::Base:
+    word |= reg(args[0]) << 6;
+    break;
+  case Form::Call:
+    word |= offset(args[0], 11);
+    break;
+  case Form::Relative:
+    word |= reg(args[0]) << 9 | offset(args[1], 9);
+    break;
+  case Form::BaseOffset:
+    word |= reg(args[0]) << 9 | reg(args[1]) << 6 | (immediate(args[2], -32, 31) & 0x3f);
+    break;
+  case Form::Fixed:
+    break;
+  case Form::Trap:
+    word |= immediate(args[0], 0, 0xff);
+    break;
+
+  case Form::Orig:
+    if (has_origin) {
+      error("an .obj image has one origin; start another file for this block");
+      return;
+    }
+    has_origin = true;
+    out.origin = static_cast<uint16_t>(immediate(args[0], 0, 0xffff));
+    return;
+  case Form::End:
+    ended = true;
+    return;
+  case Form::Fill: {
+    int32_t value;
+    if (number_of(args[0], value)) {
+      if (value < -0x8000 || value > 0xffff)
+        error(quoted(args[0]) + " does not fit in a word");
+      word = static_cast<uint16_t>(value);
+    } else {
+      word = offset(args[0], 16);
+    }
+  } break;
+  case Form::Blkw: {
+    int32_t n = immediate(args[0], 0, 0xffff);
+    for (int32_t i = 0; i < n && !full; ++i)
+      emit(0);
+    return;
+  }
+  case Form::Stringz:
+    string_literal(args[0]);
+    return;
+  }
+  emit(word);
+}
+
+auto Assembler::emit(uint16_t word) -> void {
+  if (full)
+    return;
+  if (out.origin + out.words.size() >= VM::memory_size) {
+    error("the program runs past xFFFF");
+    full = true;
+    return;
+  }
+  out.words.push_back(word);
+}
+
+auto Assembler::define(string_view label) -> void {
+  Symbol *s = symbols.find_or_add(label);
+  if (s->defined) {
+    error("label " + quoted(label) + " already defined on line " + std::to_string(s->line));
+    return;
+  }
+  s->defined = true;
+  s->address = here();
+  s->line = line_number;
+  for (const Fixup *f = s->pending; f; f = f->next)
+    patch(*f, s->address);
+  s->pending = nullptr;
+}
+
+auto Assembler::patch(const Fixup &fixup, uint16_t address) -> void {
+  if (fixup.index >= out.words.size())
+    return;
+  uint16_t &word = out.words[fixup.index];
+  if (fixup.bits == 16) {
+    word = address;
+    return;
+  }
+  int32_t distance = address - (out.origin + static_cast<int32_t>(fixup.index) + 1);
+  if (!fits(distance, fixup.bits))
+    error_at(fixup.line, "label out of reach of a " + std::to_string(fixup.bits) + "-bit offset");
+  word |= distance & ((1 << fixup.bits) - 1);
+}
+
+// the field for a label or a literal offset from the next instruction; a
+// label not defined yet leaves it zero and a fixup behind
+auto Assembler::offset(string_view arg, int bits) -> uint16_t {
+  int32_t value;
+  if (number_of(arg, value)) {
+    if (!fits(value, bits))
+      error("offset " + quoted(arg) + " does not fit in " + std::to_string(bits) + " bits");
+    return static_cast<uint16_t>(value & ((1 << bits) - 1));
+  }
+  if (!is_identifier(arg)) {
+    error("expected a label, got " + quoted(arg));
+    return 0;
+  }
+
+  Symbol *s = symbols.find_or_add(arg);
+  if (s->defined) {
+    if (bits == 16)
+      return s->address;
+    int32_t distance = s->address - (here() + 1);
+    if (!fits(distance, bits))
+      error("label out of reach of a " + std::to_string(bits) + "-bit offset");
+    return static_cast<uint16_t>(distance & ((1 << bits) - 1));
+  }
+  Fixup *fixup = arena.make<Fixup>();
+  *fixup = {static_cast<uint32_t>(out.words.size()), bits, line_number, s->pending};
+  s->pending = fixup;
+  return 0;
+}
+
+auto Assembler::reg(string_view arg) -> uint16_t {
+  int r = register_of(arg);
+  if (r < 0) {
+    error("expected a register, got " + quoted(arg));
+    return 0;
+  }
+  return static_cast<uint16_t>(r);
+}
+
+auto Assembler::immediate(string_view arg, int32_t low, int32_t high) -> int32_t {
+  int32_t value;
+  if (!number_of(arg, value)) {
+    error("expected a number, got " + quoted(arg));
+    return low;
+  }
+  if (value < low || value > high) {
+    error(quoted(arg) + " is out of range " + std::to_string(low) + ".." + std::to_string(high));
+    return low;
+  }
+  return value;
+}
+
+auto Assembler::string_literal(string_view arg) -> void {
+  if (arg.size() < 2 || arg.front() != '"') {
+    error("expected a string, got " + quoted(arg));
+    return;
+  }
+  for (size_t i = 1; i + 1 < arg.size(); ++i) {
+    char c = arg[i];
+    if (c == '\\') {
+      switch (arg[++i]) {
+      case 'n':
+        c = '\n';
+        break;
+      case 't':
+        c = '\t';
+        break;
+      case 'r':
+        c = '\r';
+        break;
+      case 'e':
+        c = '\x1b';
+        break;
+      case '0':
+        c = '\0';
+        break;
+      default: // \" and \\ stand for themselves
+        c = arg[i];
+        break;
+      }
+    }
+    emit(static_cast<uint8_t>(c));
+  }
+  emit(0);
+}
+
+// FNV-1a over the source; part of the cache key
+auto content_hash(const uint8_t *bytes, size_t size) -> uint64_t {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ bytes[i]) * 0x100000001b3;
+  return hash;
+}
+
+// bumped whenever the same source would assemble differently
+constexpr char cache_version[] = "lc3as-1";
+
+// ".<pid>.<thread>.tmp": unique among the processes and threads that share
+// a cache directory
+auto private_suffix() -> string {
+#if defined(_WIN32) || defined(_WIN64)
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+  size_t thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  return "." + std::to_string(pid) + "." + std::to_string(thread) + ".tmp";
+}
+
+} // namespace
+
+auto assemble(const char *source, size_t size) -> Assembly {
+  return Assembler(source, size).run();
+}
+
+auto write_object(const Assembly &assembly, const string &path) -> bool {
+  vector<uint8_t> bytes;
+  bytes.reserve(2 * (assembly.words.size() + 1));
+  auto put = [&bytes](uint16_t word) {
+    bytes.push_back(static_cast<uint8_t>(word >> 8));
+    bytes.push_back(static_cast<uint8_t>(word));
+  };
+  put(assembly.origin);
+  for (uint16_t word : assembly.words)
+    put(word);
+
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file)
+    return false;
+  bool ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  return std::fclose(file) == 0 && ok;
+}
+
+auto assemble_files(const vector<AssembleJob> &jobs, unsigned threads, const string &cache_dir,
+                    std::ostream &errors) -> AssembleResult {
+  auto begin = std::chrono::steady_clock::now();
+  std::error_code ec;
+  if (!cache_dir.empty())
+    fs::create_directories(cache_dir, ec);
+
+  struct Outcome {
+    string log;
+    bool failed = false;
+    bool cached = false;
+  };
+  vector<Outcome> outcomes(jobs.size());
+
+  {
+    ThreadPool pool(threads);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      pool.submit([&job = jobs[i], &outcome = outcomes[i], &cache_dir] {
+        FileView source(job.source.c_str());
+        if (!source.ok()) {
+          outcome.log = job.source + ": cannot read\n";
+          outcome.failed = true;
+          return;
+        }
+
+        fs::path cached;
+        if (!cache_dir.empty()) {
+          uint64_t key = content_hash(reinterpret_cast<const uint8_t *>(cache_version),
+                                      sizeof cache_version) ^
+                         content_hash(source.data(), source.size());
+          char name[24];
+          std::snprintf(name, sizeof name, "%016llx.obj", static_cast<unsigned long long>(key));
+          cached = fs::path(cache_dir) / name;
+          // an entry that is no image (cut short, or not ours) is a miss and
+          // gets replaced below
+          std::error_code copy_error;
+          auto size = fs::file_size(cached, copy_error);
+          if (!copy_error && size >= 2 && size % 2 == 0 &&
+              fs::copy_file(cached, job.output, fs::copy_options::overwrite_existing, copy_error)) {
+            outcome.cached = true;
+            return;
+          }
+        }
+
+        Assembly assembly =
+            assemble(reinterpret_cast<const char *>(source.data()), source.size());
+        for (const auto &e : assembly.errors)
+          outcome.log += job.source + ":" + std::to_string(e.line) + ": " + e.message + "\n";
+        if (!assembly.ok()) {
+          outcome.failed = true;
+          return;
+        }
+        if (!write_object(assembly, job.output)) {
+          outcome.log += job.output + ": cannot write\n";
+          outcome.failed = true;
+          return;
+        }
+        // written under a private name first, so that a concurrent run never
+        // copies half an image
+        if (!cached.empty()) {
+          auto partial = cached;
+          partial += private_suffix();
+          std::error_code cache_error;
+          if (write_object(assembly, partial.string()))
+            fs::rename(partial, cached, cache_error);
+        }
+      });
+    }
+    pool.wait();
+  }
+
+  AssembleResult result;
+  result.files = jobs.size();
+  for (const auto &outcome : outcomes) {
+    errors << outcome.log;
+    result.failed += outcome.failed;
+    result.cached += outcome.cached;
+  }
+  result.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+  return result;
+}
@@ -0,0 +1,53 @@
+#ifndef __ASSEMBLER_H__
+#define __ASSEMBLER_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+struct AssemblyError {
+  int line;
+  std::string message;
+};
+
+// one assembled source file: the words loaded at origin, or the errors that
+// kept it from assembling
+struct Assembly {
+  uint16_t origin = 0;
+  std::vector<uint16_t> words;
+  std::vector<AssemblyError> errors; // in line order
+
+  auto ok() const -> bool { return errors.empty(); }
+};
+
+// assembles LC-3 source in one pass: every opcode, the TRAP aliases, labels
+// and .ORIG/.FILL/.BLKW/.STRINGZ/.END. a label used before its definition
+// leaves a fixup that the definition patches. an .obj image has a single
+// origin, so a file holds one .ORIG block.
+auto assemble(const char *source, size_t size) -> Assembly;
+
+// the image as an .obj file (big-endian origin, then big-endian words)
+auto write_object(const Assembly &assembly, const std::string &path) -> bool;
+
+struct AssembleJob {
+  std::string source;
+  std::string output;
+};
+
+struct AssembleResult {
+  size_t files = 0;
+  size_t failed = 0;
+  size_t cached = 0; // copied from the cache instead of assembled
+  double seconds = 0;
+};
+
+// assembles every job across a work-stealing pool of `threads` workers.
+// with a cache directory, images are kept there under a hash of their source
+// and a source seen before is copied rather than assembled. errors go to
+// `errors` as file:line: message, in job order.
+auto assemble_files(const std::vector<AssembleJob> &jobs, unsigned threads,
+                    const std::string &cache_dir, std::ostream &errors) -> AssembleResult;
+
+#endif // __ASSEMBLER_H__
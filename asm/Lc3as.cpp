@@ -0,0 +1,62 @@
+// assembles LC-3 sources into .obj images, many files at once
+
+#include "Assembler.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static auto usage() -> void {
+  std::cout << "lc3as [-j threads] [-o out-dir] [--cache cache-dir] source-file ...\n";
+  exit(2);
+}
+
+// each source becomes <out-dir>/<source>.obj, or sits next to its source
+// without -o
+auto main(int argc, const char *argv[]) -> int {
+  unsigned threads = std::thread::hardware_concurrency();
+  std::filesystem::path out_dir;
+  string cache_dir;
+  vector<string> sources;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-j") && i + 1 < argc)
+      threads = static_cast<unsigned>(std::stoul(argv[++i]));
+    else if (!std::strcmp(argv[i], "-o") && i + 1 < argc)
+      out_dir = argv[++i];
+    else if (!std::strcmp(argv[i], "--cache") && i + 1 < argc)
+      cache_dir = argv[++i];
+    else if (argv[i][0] == '-')
+      usage();
+    else
+      sources.push_back(argv[i]);
+  }
+  if (sources.empty())
+    usage();
+
+  if (!out_dir.empty()) {
+    std::error_code ec;
+    std::filesystem::create_directories(out_dir, ec);
+  }
+  vector<AssembleJob> jobs;
+  for (const auto &source : sources) {
+    std::filesystem::path output(source);
+    output.replace_extension(".obj");
+    if (!out_dir.empty())
+      output = out_dir / output.filename();
+    jobs.push_back({source, output.string()});
+  }
+
+  auto result = assemble_files(jobs, threads, cache_dir, std::cerr);
+  if (jobs.size() > 1)
+    std::cerr << result.files << " files, " << result.failed << " failed, " << result.cached
+              << " cached, " << result.seconds * 1e3 << " ms\n";
+  return result.failed ? 1 : 0;
+}
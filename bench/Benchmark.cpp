@@ -0,0 +1,229 @@
+// times every workload of the corpus on every execution engine
+
+#include "Corpus.h"
+#include "Engine.h"
+#include "LC3.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+#if defined(_WIN32) || defined(_WIN64)
+static constexpr const char *null_device = "NUL";
+#else
+static constexpr const char *null_device = "/dev/null";
+#endif
+
+using file_ptr = std::unique_ptr<std::FILE, decltype(&fclose)>;
+
+struct Result {
+  string workload;
+  Engine engine;
+  uint64_t instructions = 0;
+  vector<double> seconds; // one per repetition
+  bool consistent = true; // same final state as the first engine
+};
+
+struct Summary {
+  double mips, mips_stddev, ns_per_instruction, best_seconds;
+};
+
+static auto summarize(const Result &result) -> Summary {
+  vector<double> mips;
+  for (double s : result.seconds)
+    mips.push_back(result.instructions / s / 1e6);
+  double mean = 0;
+  for (double m : mips)
+    mean += m;
+  mean /= mips.size();
+  double variance = 0;
+  for (double m : mips)
+    variance += (m - mean) * (m - mean);
+  variance /= mips.size() > 1 ? mips.size() - 1 : 1;
+
+  double best = *std::min_element(result.seconds.begin(), result.seconds.end());
+  return {mean, std::sqrt(variance), 1e3 / mean, best};
+}
+
+// the guest state the engines have to agree on: every register, the flags
+// included, all of memory and the instruction count
+static auto final_state(const VM &vm) -> vector<uint64_t> {
+  return {state_hash(vm), vm.retired};
+}
+
+// one untimed warm-up run, then `repetitions` timed runs on fresh copies of
+// the loaded image; console output is discarded
+static auto measure(const Workload &workload, Engine engine, int repetitions,
+                    vector<uint64_t> &state) -> Result {
+  Result result;
+  result.workload = workload.name;
+  result.engine = engine;
+
+  auto prototype = std::make_unique<VM>(nullptr, nullptr);
+  std::copy(workload.words.begin(), workload.words.end(),
+            prototype->memory.begin() + workload.origin);
+
+  file_ptr out(std::fopen(null_device, "wb"), std::fclose);
+  file_ptr in(std::tmpfile(), std::fclose);
+  if (in)
+    std::fwrite(workload.input.data(), 1, workload.input.size(), in.get());
+
+  for (int run = -1; run < repetitions; ++run) {
+    if (in)
+      std::rewind(in.get());
+    auto vm = std::make_unique<VM>(*prototype);
+    vm->set_io(in.get(), out.get());
+    vm->set_output_buffering(Flush::Full);
+
+    auto start = std::chrono::steady_clock::now();
+    ::run(*vm, engine);
+    auto stop = std::chrono::steady_clock::now();
+
+    if (run < 0) {
+      result.instructions = vm->retired;
+      if (state.empty())
+        state = final_state(*vm);
+      result.consistent = state == final_state(*vm);
+      continue;
+    }
+    result.seconds.push_back(std::chrono::duration<double>(stop - start).count());
+  }
+  return result;
+}
+
+static auto print_text(const vector<Result> &results) -> void {
+  cout << std::left << std::setw(10) << "workload" << std::setw(10) << "engine" << std::right
+       << std::setw(12) << "instrs" << std::setw(10) << "MIPS" << std::setw(9) << "+/-"
+       << std::setw(10) << "ns/instr" << std::setw(10) << "best s" << '\n';
+  cout << std::fixed;
+  for (const auto &r : results) {
+    auto s = summarize(r);
+    cout << std::left << std::setw(10) << r.workload << std::setw(10) << engine_name(r.engine)
+         << std::right << std::setw(12) << r.instructions << std::setprecision(1)
+         << std::setw(10) << s.mips << std::setw(9) << s.mips_stddev << std::setprecision(2)
+         << std::setw(10) << s.ns_per_instruction << std::setprecision(4) << std::setw(10)
+         << s.best_seconds << (r.consistent ? "" : "  MISMATCH") << '\n';
+  }
+}
+
+static auto print_csv(const vector<Result> &results) -> void {
+  cout << "workload,engine,instructions,repetitions,mips,mips_stddev,ns_per_instruction,"
+          "best_seconds,consistent\n";
+  cout << std::setprecision(6);
+  for (const auto &r : results) {
+    auto s = summarize(r);
+    cout << r.workload << ',' << engine_name(r.engine) << ',' << r.instructions << ','
+         << r.seconds.size() << ',' << s.mips << ',' << s.mips_stddev << ','
+         << s.ns_per_instruction << ',' << s.best_seconds << ',' << r.consistent << '\n';
+  }
+}
+
+static auto print_json(const vector<Result> &results) -> void {
+  cout << "[\n" << std::setprecision(6);
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &r = results[i];
+    auto s = summarize(r);
+    cout << "  {\"workload\": \"" << r.workload << "\", \"engine\": \"" << engine_name(r.engine)
+         << "\", \"instructions\": " << r.instructions << ", \"seconds\": [";
+    for (size_t j = 0; j < r.seconds.size(); ++j)
+      cout << (j ? ", " : "") << r.seconds[j];
+    cout << "], \"mips\": " << s.mips << ", \"mips_stddev\": " << s.mips_stddev
+         << ", \"ns_per_instruction\": " << s.ns_per_instruction
+         << ", \"consistent\": " << (r.consistent ? "true" : "false") << "}"
+         << (i + 1 < results.size() ? "," : "") << '\n';
+  }
+  cout << "]\n";
+}
+
+static auto usage() -> void {
+  cout << "lc3bench [-n repetitions] [--scale factor] [--engine name] ... "
+          "[--workload name] ... [--format text|csv|json] [--write-corpus dir]\n";
+  exit(2);
+}
+
+auto main(int argc, const char *argv[]) -> int {
+  int repetitions = 5;
+  double scale = 1;
+  vector<Engine> engines;
+  vector<string> names;
+  string format = "text";
+  const char *corpus_dir = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-n") && i + 1 < argc)
+      repetitions = std::max(1, std::atoi(argv[++i]));
+    else if (!std::strcmp(argv[i], "--scale") && i + 1 < argc)
+      scale = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--engine") && i + 1 < argc) {
+      Engine engine;
+      if (!parse_engine(argv[++i], engine))
+        usage();
+      engines.push_back(engine);
+    } else if (!std::strcmp(argv[i], "--workload") && i + 1 < argc)
+      names.push_back(argv[++i]);
+    else if (!std::strcmp(argv[i], "--format") && i + 1 < argc)
+      format = argv[++i];
+    else if (!std::strcmp(argv[i], "--write-corpus") && i + 1 < argc)
+      corpus_dir = argv[++i];
+    else
+      usage();
+  }
+  if (format != "text" && format != "csv" && format != "json")
+    usage();
+  if (engines.empty())
+    engines = {Engine::Switch, Engine::Threaded, Engine::Lazy, Engine::Fused, Engine::JIT};
+
+  auto corpus = make_corpus(scale);
+  if (!names.empty())
+    corpus.erase(std::remove_if(corpus.begin(), corpus.end(),
+                                [&](const Workload &w) {
+                                  return std::find(names.begin(), names.end(), w.name) ==
+                                         names.end();
+                                }),
+                 corpus.end());
+
+  if (corpus_dir) {
+    for (const auto &workload : corpus) {
+      auto path = (std::filesystem::path(corpus_dir) / (workload.name + ".obj")).string();
+      if (!write_image(workload, path)) {
+        std::cerr << "failed to write image: " << path << '\n';
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  vector<Result> results;
+  bool consistent = true;
+  for (const auto &workload : corpus) {
+    vector<uint64_t> state;
+    for (Engine engine : engines) {
+      results.push_back(measure(workload, engine, repetitions, state));
+      consistent &= results.back().consistent;
+    }
+  }
+
+  if (format == "csv")
+    print_csv(results);
+  else if (format == "json")
+    print_json(results);
+  else
+    print_text(results);
+
+  if (!consistent)
+    std::cerr << "engines disagree on the final guest state\n";
+  return consistent ? 0 : 1;
+}
@@ -0,0 +1,311 @@
+#include "Corpus.h"
+#include "LC3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace {
+
+// just enough of an assembler to write the corpus: one instruction per call,
+// labels resolved once the program is complete
+class Builder {
+public:
+  explicit Builder(uint16_t origin = VM::PC_START) : origin(origin) {}
+
+  auto label(const string &name) -> Builder & {
+    labels[name] = here();
+    return *this;
+  }
+
+  auto add(int dr, int sr, int imm) -> Builder & { return imm5(0x1000, dr, sr, imm); }
+  auto add_reg(int dr, int sr1, int sr2) -> Builder & { return reg3(0x1000, dr, sr1, sr2); }
+  auto and_(int dr, int sr, int imm) -> Builder & { return imm5(0x5000, dr, sr, imm); }
+  auto not_(int dr, int sr) -> Builder & { return emit(0x903f | dr << 9 | sr << 6); }
+  auto ldr(int dr, int base, int offset) -> Builder & { return off6(0x6000, dr, base, offset); }
+  auto str(int sr, int base, int offset) -> Builder & { return off6(0x7000, sr, base, offset); }
+  auto ld(int dr, const string &target) -> Builder & { return pc9(0x2000 | dr << 9, target); }
+  auto ldi(int dr, const string &target) -> Builder & { return pc9(0xa000 | dr << 9, target); }
+  auto lea(int dr, const string &target) -> Builder & { return pc9(0xe000 | dr << 9, target); }
+  auto br(const char *nzp, const string &target) -> Builder & {
+    uint16_t cond = 0;
+    for (; *nzp; ++nzp)
+      cond |= *nzp == 'n' ? 4 : *nzp == 'z' ? 2 : 1;
+    return pc9(cond << 9, target);
+  }
+  auto jsr(const string &target) -> Builder & {
+    fixups.push_back({here(), 11, target});
+    return emit(0x4800);
+  }
+  auto ret() -> Builder & { return emit(0xc1c0); }
+  auto trap(uint16_t vector) -> Builder & { return emit(0xf000 | vector); }
+  auto fill(uint16_t value) -> Builder & { return emit(value); }
+  auto stringz(const string &text) -> Builder & {
+    for (char c : text)
+      emit(static_cast<uint8_t>(c));
+    return emit(0);
+  }
+
+  auto build() -> vector<uint16_t> {
+    for (const auto &fixup : fixups) {
+      int offset = labels.at(fixup.target) - (fixup.address + 1);
+      words[fixup.address - origin] |= offset & ((1 << fixup.bits) - 1);
+    }
+    return words;
+  }
+
+private:
+  struct Fixup {
+    uint16_t address;
+    int bits;
+    string target;
+  };
+
+  auto here() const -> uint16_t { return static_cast<uint16_t>(origin + words.size()); }
+
+  auto emit(uint16_t word) -> Builder & {
+    words.push_back(word);
+    return *this;
+  }
+  auto imm5(uint16_t op, int dr, int sr, int imm) -> Builder & {
+    return emit(op | dr << 9 | sr << 6 | 0x20 | (imm & 0x1f));
+  }
+  auto reg3(uint16_t op, int dr, int sr1, int sr2) -> Builder & {
+    return emit(op | dr << 9 | sr1 << 6 | sr2);
+  }
+  auto off6(uint16_t op, int r, int base, int offset) -> Builder & {
+    return emit(op | r << 9 | base << 6 | (offset & 0x3f));
+  }
+  auto pc9(uint16_t op, const string &target) -> Builder & {
+    fixups.push_back({here(), 9, target});
+    return emit(op);
+  }
+
+  uint16_t origin;
+  vector<uint16_t> words;
+  map<string, uint16_t> labels;
+  vector<Fixup> fixups;
+};
+
+auto scaled(double count, double scale) -> uint16_t {
+  return static_cast<uint16_t>(std::clamp(std::lround(count * scale), 1L, 0x7fffL));
+}
+
+// ADD/AND/NOT in a nested counted loop
+auto arithmetic(double scale) -> Workload {
+  Builder b;
+  b.ld(1, "outer")
+      .label("next")
+      .ld(2, "inner")
+      .label("loop")
+      .add_reg(3, 3, 2)
+      .and_(4, 3, 15)
+      .not_(5, 4)
+      .add_reg(5, 5, 3)
+      .add(2, 2, -1)
+      .br("p", "loop")
+      .add(1, 1, -1)
+      .br("p", "next")
+      .trap(TrapCodes::TRAP_HALT)
+      .label("outer")
+      .fill(scaled(330, scale))
+      .label("inner")
+      .fill(10000);
+  return {"arith", "nested ADD/AND/NOT loop", VM::PC_START, b.build(), ""};
+}
+
+// fills a 1024-word block, then copies it word by word with LDR/STR
+auto memory_copy(double scale) -> Workload {
+  Builder b;
+  b.ld(2, "src")
+      .ld(4, "count")
+      .label("init")
+      .str(4, 2, 0)
+      .add(2, 2, 1)
+      .add(4, 4, -1)
+      .br("p", "init")
+      .ld(1, "passes")
+      .label("pass")
+      .ld(2, "src")
+      .ld(3, "dst")
+      .ld(4, "count")
+      .label("copy")
+      .ldr(5, 2, 0)
+      .str(5, 3, 0)
+      .add(2, 2, 1)
+      .add(3, 3, 1)
+      .add(4, 4, -1)
+      .br("p", "copy")
+      .add(1, 1, -1)
+      .br("p", "pass")
+      .trap(TrapCodes::TRAP_HALT)
+      .label("passes")
+      .fill(scaled(3000, scale))
+      .label("src")
+      .fill(0x4000)
+      .label("dst")
+      .fill(0x5000)
+      .label("count")
+      .fill(1024);
+  return {"memcpy", "1024-word LDR/STR block copy", VM::PC_START, b.build(), ""};
+}
+
+// naive recursive fibonacci: JSR/RET with R7 and registers saved on an R6 stack
+auto recursion(double scale) -> Workload {
+  Builder b;
+  b.ld(6, "stack")
+      .ld(1, "reps")
+      .label("rep")
+      .ld(0, "n")
+      .jsr("fib")
+      .add(1, 1, -1)
+      .br("p", "rep")
+      .trap(TrapCodes::TRAP_HALT)
+      // R0 = fib(R0)
+      .label("fib")
+      .add(6, 6, -1)
+      .str(7, 6, 0)
+      .add(6, 6, -1)
+      .str(2, 6, 0)
+      .add(6, 6, -1)
+      .str(3, 6, 0)
+      .add(3, 0, -2)
+      .br("n", "done")
+      .add(3, 0, 0)
+      .add(0, 3, -1)
+      .jsr("fib")
+      .add(2, 0, 0)
+      .add(0, 3, -2)
+      .jsr("fib")
+      .add_reg(0, 0, 2)
+      .label("done")
+      .ldr(3, 6, 0)
+      .add(6, 6, 1)
+      .ldr(2, 6, 0)
+      .add(6, 6, 1)
+      .ldr(7, 6, 0)
+      .add(6, 6, 1)
+      .ret()
+      .label("reps")
+      .fill(scaled(6, scale))
+      .label("n")
+      .fill(24)
+      .label("stack")
+      .fill(0xf000);
+  return {"recursion", "recursive fib(24) through JSR/RET", VM::PC_START, b.build(), ""};
+}
+
+// a 64-character line printed over and over with TRAP PUTS
+auto string_output(double scale) -> Workload {
+  Builder b;
+  b.ld(2, "blocks")
+      .label("block")
+      .ld(1, "lines")
+      .label("line")
+      .lea(0, "text")
+      .trap(TrapCodes::TRAP_PUTS)
+      .add(1, 1, -1)
+      .br("p", "line")
+      .add(2, 2, -1)
+      .br("p", "block")
+      .trap(TrapCodes::TRAP_HALT)
+      .label("blocks")
+      .fill(scaled(50, scale))
+      .label("lines")
+      .fill(10000)
+      .label("text")
+      .stringz("the quick brown fox jumps over the lazy dog 0123456789 abcdefg\n");
+  return {"puts", "64-character lines through TRAP PUTS", VM::PC_START, b.build(), ""};
+}
+
+// spins on KBSR for every key of a scripted input and sums the keys read
+auto keyboard_polling(double scale) -> Workload {
+  uint16_t blocks = scaled(50, scale);
+  constexpr uint16_t keys = 10000;
+  Builder b;
+  b.ld(5, "blocks")
+      .label("block")
+      .ld(4, "keys")
+      .label("poll")
+      .ldi(1, "kbsr")
+      .br("zp", "poll")
+      .ldi(0, "kbdr")
+      .add_reg(3, 3, 0)
+      .add(4, 4, -1)
+      .br("p", "poll")
+      .add(5, 5, -1)
+      .br("p", "block")
+      .trap(TrapCodes::TRAP_HALT)
+      .label("blocks")
+      .fill(blocks)
+      .label("keys")
+      .fill(keys)
+      .label("kbsr")
+      .fill(MappedReg::MR_KBSR)
+      .label("kbdr")
+      .fill(MappedReg::MR_KBDR);
+
+  string input(size_t(blocks) * keys, 0);
+  for (size_t i = 0; i < input.size(); ++i)
+    input[i] = static_cast<char>('a' + i % 26);
+  return {"kbsr", "KBSR/KBDR polling of scripted input", VM::PC_START, b.build(), input};
+}
+
+// a JSR right after setting the flags through R7, which JSR overwrites:
+// the subroutine branches on the value, not on the return address
+auto call_flags(double scale) -> Workload {
+  Builder b;
+  b.ld(2, "blocks")
+      .label("block")
+      .ld(1, "calls")
+      .label("call")
+      .and_(0, 1, 1)
+      .add(7, 0, -1)
+      .jsr("sign")
+      .add(1, 1, -1)
+      .br("p", "call")
+      .add(2, 2, -1)
+      .br("p", "block")
+      .trap(TrapCodes::TRAP_HALT)
+      // counts negative R7 in R4, the rest in R3
+      .label("sign")
+      .br("n", "negative")
+      .add(3, 3, 1)
+      .ret()
+      .label("negative")
+      .add(4, 4, 1)
+      .ret()
+      .label("blocks")
+      .fill(scaled(100, scale))
+      .label("calls")
+      .fill(10000);
+  return {"jsrflags", "flags set through R7 just before JSR", VM::PC_START, b.build(), ""};
+}
+
+} // namespace
+
+auto make_corpus(double scale) -> vector<Workload> {
+  return {arithmetic(scale), memory_copy(scale), recursion(scale), string_output(scale),
+          keyboard_polling(scale), call_flags(scale)};
+}
+
+auto write_image(const Workload &workload, const string &path) -> bool {
+  auto file = std::unique_ptr<std::FILE, decltype(&fclose)>(std::fopen(path.c_str(), "wb"),
+                                                            std::fclose);
+  if (!file)
+    return false;
+  auto put = [&](uint16_t word) {
+    std::fputc(word >> 8, file.get());
+    std::fputc(word & 0xff, file.get());
+  };
+  put(workload.origin);
+  for (uint16_t word : workload.words)
+    put(word);
+  return !std::ferror(file.get());
+}
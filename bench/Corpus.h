@@ -0,0 +1,25 @@
+#ifndef __CORPUS_H__
+#define __CORPUS_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// deterministic, self-halting guest programs for the benchmark. each one is
+// generated here rather than shipped as an .obj so that its size can be
+// scaled and the corpus can never drift from the benchmark.
+struct Workload {
+  std::string name;
+  std::string description;
+  uint16_t origin;
+  std::vector<uint16_t> words; // native-endian image loaded at origin
+  std::string input;           // scripted keyboard input
+};
+
+// every workload, with its iteration counts multiplied by `scale`
+auto make_corpus(double scale) -> std::vector<Workload>;
+
+// the workload as an .obj file (big-endian origin, then big-endian words)
+auto write_image(const Workload &workload, const std::string &path) -> bool;
+
+#endif // __CORPUS_H__
@@ -0,0 +1,45 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include "LC3.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// ahead-of-time translation of an .obj image into a C++ program with one
+// function per reachable basic block. the generated program links against
+// the interpreter library and runs through run_aot.
+
+// a translated block returns the PC to continue at
+using aot_fn = uint16_t (*)(VM &vm);
+
+struct AotBlock {
+  uint16_t start;
+  uint16_t length; // words covered, used to detect stores into the block
+  aot_fn run;
+};
+
+struct AotProgram {
+  uint16_t origin;
+  const uint16_t *image; // native-endian words loaded at origin
+  size_t image_size;
+  const AotBlock *blocks;
+  size_t block_count;
+};
+
+// writes the translation of the image at image_path as C++ source
+auto aot_translate(const char *image_path, std::ostream &out) -> bool;
+
+// translates image_path and builds it into an executable at output_path
+// (or only writes the C++ source there when emit_cpp is set)
+auto aot_compile(const char *image_path, const char *output_path, bool emit_cpp) -> int;
+
+// runtime of generated programs: dispatches translated blocks by PC and
+// runs everything else, including blocks whose code was overwritten, on the
+// interpreter
+auto run_aot(VM &vm, const AotProgram &program) -> void;
+
+auto aot_main(int argc, const char *argv[], const AotProgram &program) -> int;
+
+#endif // __AOT_H__
@@ -0,0 +1,34 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "Engine.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// one guest run: an image, the file its keyboard reads from and the file its
+// console writes to. an empty input means the guest gets no input at all;
+// the output is required.
+struct BatchJob {
+  std::string image;
+  std::string input;
+  std::string output;
+};
+
+struct BatchResult {
+  size_t jobs = 0;
+  size_t failed = 0;
+  uint64_t instructions = 0; // retired by all guests together
+  double seconds = 0;
+};
+
+// runs every job on its own VM across a work-stealing pool of `threads`
+// workers. each distinct image is read from disk once and copied per job.
+// with Engine::Lockstep, each task runs up to LOCKSTEP_LANES jobs of one
+// image together.
+auto run_batch(const std::vector<BatchJob> &jobs, unsigned threads,
+               Engine engine = Engine::Switch) -> BatchResult;
+
+#endif // __BATCH_H__
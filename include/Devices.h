@@ -0,0 +1,49 @@
+#ifndef __DEVICES_H__
+#define __DEVICES_H__
+
+#include <cstdint>
+
+class VM;
+
+// a memory-mapped device on the I/O page. the VM's memory at the device's
+// addresses is its register file; a device only overrides what it needs.
+class Device {
+public:
+  virtual ~Device() = default;
+
+  virtual auto read(VM &vm, uint16_t address) -> uint16_t;
+
+  virtual auto write(VM &vm, uint16_t address, uint16_t value) -> void;
+};
+
+// KBSR/KBDR: polling KBSR latches the next key into KBDR
+class Keyboard : public Device {
+public:
+  auto read(VM &vm, uint16_t address) -> uint16_t override;
+};
+
+// DSR/DDR: the display is always ready; a write to DDR prints a character
+class Display : public Device {
+public:
+  auto read(VM &vm, uint16_t address) -> uint16_t override;
+  auto write(VM &vm, uint16_t address, uint16_t value) -> void override;
+};
+
+// MCR: clearing bit 15 stops the machine
+class MachineControl : public Device {
+public:
+  auto read(VM &vm, uint16_t address) -> uint16_t override;
+  auto write(VM &vm, uint16_t address, uint16_t value) -> void override;
+};
+
+// TMR: milliseconds of host monotonic time, wrapping at 16 bits
+class Timer : public Device {
+public:
+  auto read(VM &vm, uint16_t address) -> uint16_t override;
+};
+
+// maps the devices above at their MappedReg addresses. they keep no state of
+// their own, so one shared instance of each serves every VM.
+auto attach_standard_devices(VM &vm) -> void;
+
+#endif // __DEVICES_H__
@@ -0,0 +1,23 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+class VM;
+
+// execution engines selectable at runtime; all of them run the same guest
+// semantics and differ only in how instructions are dispatched.
+enum class Engine {
+  Switch,   // VM::run_vm, decode and switch on every step
+  Threaded, // run_threaded, pre-decoded table with computed-goto dispatch
+  Lazy,     // run_lazy, threaded with lazy condition codes
+  Fused,    // run_fused, lazy with superinstructions
+  JIT,      // run_jit, basic blocks translated to x86-64
+  Lockstep, // run_lockstep, many guests at once in SIMD lanes (batch mode)
+};
+
+auto parse_engine(const char *name, Engine &engine) -> bool;
+
+auto engine_name(Engine engine) -> const char *;
+
+auto run(VM &vm, Engine engine) -> void;
+
+#endif // __ENGINE_H__
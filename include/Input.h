@@ -0,0 +1,109 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+// single-producer/single-consumer ring; push and pop never block or lock
+template <typename T, size_t N> class SpscRing {
+  static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+  auto push(T value) -> bool {
+    size_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail - head.load(std::memory_order_acquire) == N)
+      return false;
+    slots[tail & (N - 1)] = value;
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  auto pop(T &value) -> bool {
+    size_t head = this->head.load(std::memory_order_relaxed);
+    if (head == tail.load(std::memory_order_acquire))
+      return false;
+    value = slots[head & (N - 1)];
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  auto empty() const -> bool {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  // free slots; exact for the producer, a lower bound for anyone else
+  auto space() const -> size_t {
+    return N - (tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+  }
+
+private:
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  std::array<T, N> slots{};
+};
+
+// keyboard input read ahead by a dedicated thread. the guest side (KBSR,
+// TRAP GETC/IN) only touches the ring, so polling costs no syscalls; a guest
+// that keeps polling an empty keyboard is parked until a key arrives or
+// idle_timeout passes.
+class InputQueue {
+public:
+  static constexpr unsigned spin_polls = 64; // empty polls before parking
+
+  explicit InputQueue(std::FILE *in,
+                      std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(10));
+
+  // a queue without a reader thread, filled through feed() and close() by
+  // its owner; polling it never parks
+  InputQueue();
+  ~InputQueue();
+
+  // queues keys read elsewhere; returns how many fit
+  auto feed(const char *keys, size_t count) -> size_t;
+
+  // no more keys will be fed
+  auto close() -> void;
+
+  auto space() const -> size_t { return ring.space(); }
+
+  // a key can be taken without waiting
+  auto ready() const -> bool { return !ring.empty(); }
+
+  InputQueue(const InputQueue &) = delete;
+  auto operator=(const InputQueue &) -> InputQueue & = delete;
+
+  // a key is ready; parks the caller after spin_polls misses in a row
+  auto poll() -> bool;
+
+  // next key, waiting for it if needed; EOF once input has ended
+  auto pop() -> int;
+
+  // input has ended and every key has been consumed
+  auto exhausted() const -> bool { return eof.load(std::memory_order_acquire) && ring.empty(); }
+
+private:
+  auto reader() -> void;
+  auto wait_for_key(bool bounded) -> void;
+
+  SpscRing<uint8_t, 4096> ring;
+  std::atomic<bool> eof{false};
+  std::atomic<bool> stopping{false};
+  unsigned misses = 0;
+  std::chrono::milliseconds idle_timeout{0};
+
+  std::mutex park_lock;
+  std::condition_variable key_ready;
+
+  int fd = -1;
+  int wake_pipe[2] = {-1, -1};
+  std::thread thread;
+};
+
+#endif // __INPUT_H__
@@ -0,0 +1,16 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+class VM;
+
+// true when this build can emit native code (x86-64 on a POSIX host)
+auto jit_supported() -> bool;
+
+// basic-block translator to x86-64. blocks are translated on first entry and
+// chained to each other by patching their exits into direct jumps. TRAPs,
+// RTI/RES and any access to the 0xFE00 device page leave translated code and
+// run one instruction through VM::step; a store into translated code flushes
+// every translation. falls back to run_threaded where unsupported.
+auto run_jit(VM &vm) -> void;
+
+#endif // __JIT_H__
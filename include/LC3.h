@@ -5,7 +5,11 @@
 
 #include <cstdint>
 #include <array>
-#include <memory>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
 
 // registers
 namespace Registers {
@@ -24,8 +28,13 @@ namespace Registers {
 
 // memory mapped registers
 namespace MappedReg {
-constexpr uint16_t MR_KBSR = 0xfe00;
-constexpr uint16_t MR_KBDR = 0xfe02;
+constexpr uint16_t IO_PAGE = 0xfe00; /* 0xfe00-0xffff is device space */
+constexpr uint16_t MR_KBSR = 0xfe00; /* keyboard status */
+constexpr uint16_t MR_KBDR = 0xfe02; /* keyboard data */
+constexpr uint16_t MR_DSR = 0xfe04;  /* display status */
+constexpr uint16_t MR_DDR = 0xfe06;  /* display data */
+constexpr uint16_t MR_TMR = 0xfe08;  /* free-running millisecond timer */
+constexpr uint16_t MR_MCR = 0xfffe;  /* machine control */
 } // namespace MappedReg
 
 // instruction set definition
@@ -65,26 +74,252 @@ constexpr uint16_t TRAP_PUTSP = 0x24;
 constexpr uint16_t TRAP_HALT = 0x25;
 } // namespace TrapCodes
 
-auto read_mem(uint16_t address) -> uint16_t;
+// mnemonics, indexed by opcode
+extern const char *const opcode_names[16];
 
-auto write_mem(uint16_t address, uint16_t value) -> void;
+// the trap table holds the routine address of each TRAP vector; the
+// interrupt vector table that of each exception and interrupt
+namespace Vectors {
+constexpr uint16_t TRAP_TABLE = 0x0000;
+constexpr uint16_t INTERRUPT_TABLE = 0x0100;
+constexpr uint16_t PRIVILEGE_MODE = 0x00; /* RTI outside an OS */
+constexpr uint16_t ILLEGAL_OPCODE = 0x01; /* RES */
+} // namespace Vectors
 
 auto extend_sign(uint16_t x, int bit_count) -> uint16_t;
 
-auto update_flags(uint16_t idx) -> void;
-
 auto swap_16(uint16_t x) -> uint16_t;
 
+// converts `count` big-endian words at `src` to native words at `dst`; many
+// words at a time where the compiler has vector instructions. dst may be
+// the same memory as src.
+auto swap_words(uint16_t *dst, const uint8_t *src, size_t count) -> void;
+
+constexpr auto flags_of(uint16_t value) -> uint16_t {
+  return value == 0 ? Flags::FL_ZRO : value >> 15 ? Flags::FL_NEG : Flags::FL_POS;
+}
+
+// SIGINT. the first asks the running guest to stop: every engine checks
+// the flag at least at its jumps and device accesses, and leaves
+// through its normal exit path, so that buffered output, recordings and
+// profiles are written as at HALT. a second SIGINT ends the process at once.
+// the handler only stores the flag and writes to a pipe.
+auto install_interrupt_handler() -> void;
 auto handle_interrupt(int signal) -> void;
 
-static auto make_unique_file_ptr(const char* fname, const char* flags) -> std::unique_ptr<std::FILE, decltype(&fclose)>;
+extern std::atomic<bool> interrupt_requested;
+
+// readable once SIGINT has arrived, for threads asleep in poll(); -1 before
+// install_interrupt_handler() and on Windows
+auto interrupt_fd() -> int;
+
+// when buffered guest console output is handed to the output stream
+enum class Flush {
+  Always, // at the end of every TRAP or DDR write (interactive default)
+  Line,   // at each newline
+  Full,   // when the buffer fills, and at HALT
+};
+
+// "always", "line" or "full"; false for anything else
+auto parse_flush(const char *name, Flush &flush) -> bool;
+
+// how TRAP, RTI and RES run
+enum class Traps {
+  // standard TRAP vectors are emulated on the host; other vectors with an
+  // entry in the trap table run the guest's routine
+  Native,
+  // every TRAP jumps through the trap table into the OS loaded with the
+  // program (R7 = PC, PC = table entry), and RTI returns from an exception
+  // or interrupt by popping PC and PSR off the R6 stack
+  Guest,
+};
+
+// why VM::run_for returned
+enum class RunStatus {
+  Budget, // the instruction budget ran out
+  Input,  // the guest waits for a key its input queue does not have yet
+  Halted, // the guest stopped
+};
+
+struct Decoded;
+class Device;
+class InputQueue;
+class Counters;
+class Profiler;
+class Recorder;
+class Replayer;
+
+// a single LC3 machine: memory, registers and the guest's I/O streams.
+// instances share no state, so any number of them can run concurrently.
+class VM {
+public:
+  static constexpr uint32_t memory_size = 1 << 16;
+  static constexpr uint16_t PC_START = 0x3000;
+
+  explicit VM(std::FILE *in = stdin, std::FILE *out = stdout);
+
+  static constexpr uint32_t io_page_size = memory_size - MappedReg::IO_PAGE;
+
+  // ordinary memory is a plain array access; only the I/O page is routed to
+  // the device attached at that address, if any
+  auto read_mem(uint16_t address) -> uint16_t {
+    if (address < MappedReg::IO_PAGE) [[likely]]
+      return memory[address];
+    return read_device(address);
+  }
+
+  auto write_mem(uint16_t address, uint16_t value) -> void;
+
+  // maps `device` (not owned) at an address of the I/O page; nullptr
+  // turns the address back into plain memory
+  auto attach(uint16_t address, Device *device) -> void;
+
+  auto update_flags(uint16_t idx) -> void;
+
+  // an .obj image in memory: a big-endian origin, then big-endian words.
+  // fails without touching memory if the words would run past 0xffff
+  auto load_image(const uint8_t *bytes, size_t size) -> bool;
+
+  auto read_image_file(std::FILE *file) -> bool;
+
+  // an .obj image, or a snapshot written by save_snapshot; the file is
+  // mapped rather than read where possible
+  auto read_image(const char *image_path) -> int;
+
+  // TRAP, RTI and RES: everything VM::step does not execute inline
+  auto trap_routines(uint16_t instruction) -> void;
+
+  auto set_traps(Traps mode) -> void { traps = mode; }
+
+  auto step() -> void;
+
+  // prepares a run: from PC_START with the Z flag set, or, right after a
+  // snapshot was loaded, from the state it captured
+  auto start() -> void;
+
+  auto run_vm() -> void;
+
+  // adds the instructions retired since the last call, and the opcodes
+  // counted since, to the metrics of the calling thread; engines call it
+  // when they stop. the switch engine adds its instructions every 64K, and
+  // the VM itself at every trap and every keyboard poll that finds no key
+  auto publish() -> void;
+
+  // resumable run of at most `budget` instructions, after start(). with an
+  // input queue, a guest waiting for a key (TRAP GETC/IN, or polling KBSR
+  // InputQueue::spin_polls times in a row) returns RunStatus::Input instead
+  // of blocking or spinning; it picks up where it left off on the next call.
+  auto run_for(uint64_t budget) -> RunStatus;
+
+  // redirects guest I/O; a non-interactive input is never polled with select()
+  auto set_io(std::FILE *in, std::FILE *out) -> void;
+
+  // keyboard read ahead on another thread (not owned); replaces polling the
+  // input stream until reset to nullptr
+  auto set_input_queue(InputQueue *queue) -> void { input = queue; }
+
+  // guest console, as used by TRAPs and the keyboard/display devices
+  auto poll_key() -> uint16_t;
+  auto get_char() -> uint16_t;
+
+  // the free-running millisecond timer as the guest sees it
+  auto clock() -> uint16_t;
+  auto output() const -> std::FILE * { return out; }
+
+  // console output is collected in a buffer and written out per `policy`;
+  // `size` is the threshold at which a Flush::Full buffer is written
+  auto set_output_buffering(Flush policy, size_t size = 1 << 20) -> void;
+
+  auto put(char c) -> void {
+    pending.push_back(c);
+    if ((c == '\n' && flush_policy == Flush::Line) || pending.size() >= flush_threshold)
+      flush_output();
+  }
+
+  auto put(const char *text, size_t size) -> void {
+    pending.insert(pending.end(), text, text + size);
+    wrote(size);
+  }
+
+  // ends one guest write; only Flush::Always writes it out right away
+  auto end_output() -> void {
+    if (flush_policy == Flush::Always)
+      flush_output();
+  }
+
+  auto flush_output() -> void;
+
+  std::array<uint16_t, memory_size> memory{}; // 128KB memory store
+  std::array<uint16_t, Registers::R_COUNT> registers{};
+  bool is_running = false;
+  bool resume = false;  // the next start() keeps PC and flags
+  uint64_t retired = 0; // instructions executed, across all runs
+
+  // when set, run_vm accounts every instruction to it (not owned)
+  Profiler *profiler = nullptr;
+
+  // when set, every keyboard poll, key and timer reading is logged to the
+  // recorder, or taken from the replayer instead of the real input (not
+  // owned)
+  Recorder *recorder = nullptr;
+  Replayer *replayer = nullptr;
+
+  // decode cache of the threaded engine while it runs; stores invalidate it
+  Decoded *decoded = nullptr;
+
+  // addresses covered by JIT translations; a store to one sets code_dirty
+  const uint8_t *code_map = nullptr;
+  bool code_dirty = false;
+
+private:
+  // stops the guest once SIGINT has arrived. the VM checks it after every
+  // device access, which engines already leave after when the input ends
+  auto interrupted() -> bool {
+    if (!interrupt_requested.load(std::memory_order_relaxed)) [[likely]]
+      return false;
+    is_running = false;
+    return true;
+  }
+
+  auto read_device(uint16_t address) -> uint16_t;
+  auto poll_input() -> uint16_t;
+  auto read_input() -> uint16_t;
+
+  auto put_string(uint16_t address) -> void;
+  auto put_packed_string(uint16_t address) -> void;
+  auto exception(uint16_t vector, uint16_t instruction) -> void;
+  auto publish_retired() -> void;
+
+  // the last `size` characters were appended to `pending`
+  auto wrote(size_t size) -> void {
+    if ((flush_policy == Flush::Line &&
+         std::memchr(pending.data() + pending.size() - size, '\n', size)) ||
+        pending.size() >= flush_threshold)
+      flush_output();
+  }
+
+  std::array<Device *, io_page_size> devices{};
 
-auto read_image_file(std::FILE* file) -> void;
+  std::FILE *in;
+  std::FILE *out;
+  bool interactive;
+  InputQueue *input = nullptr;
+  Traps traps = Traps::Native;
+  int lookahead = EOF; // a key poll_input has read from `in` but not handed out
 
-auto read_image(const char *image_path) -> int;
+  bool slicing = false;     // inside run_for
+  bool starved = false;     // waiting for input, run_for should return
+  unsigned empty_polls = 0; // KBSR polls in a row that found no key
 
-inline auto trap_routines(uint16_t& instruction, bool& is_running) -> void;
+  // metrics block of the thread running the guest, bound by start() and
+  // run_for()
+  Counters *counters;
+  uint64_t published = 0;                 // retired already counted there
+  std::array<uint64_t, 16> unpublished{}; // opcodes run, not yet counted
 
-auto run_vm() -> void;
+  std::vector<char> pending; // console output not yet written to `out`
+  Flush flush_policy = Flush::Always;
+  size_t flush_threshold = 1 << 12;
+};
 
 #endif // __LC3_H__
\ No newline at end of file
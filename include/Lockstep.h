@@ -0,0 +1,28 @@
+#ifndef __LOCKSTEP_H__
+#define __LOCKSTEP_H__
+
+#include <cstddef>
+
+class VM;
+
+// guests executed together, one 16-bit SIMD lane each: as many as fill one
+// vector register of the target
+#if defined(__AVX512BW__)
+constexpr size_t LOCKSTEP_LANES = 32;
+#elif defined(__AVX2__)
+constexpr size_t LOCKSTEP_LANES = 16;
+#else
+constexpr size_t LOCKSTEP_LANES = 8;
+#endif
+
+// runs every VM from VM::start() until it stops, LOCKSTEP_LANES at a time.
+// guests at the same PC execute each instruction once for all of them:
+// registers live in struct-of-arrays vectors, ADD/AND/NOT/LEA and the flags
+// are computed for every lane at once, loads, stores and TRAPs go lane by
+// lane. guests whose branches disagree continue as separate groups that
+// merge again when their PCs meet. a guest that stores into code run in
+// lockstep, or that starts from a different image or PC, finishes on
+// VM::step.
+auto run_lockstep(VM *const *vms, size_t count) -> void;
+
+#endif // __LOCKSTEP_H__
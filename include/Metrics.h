@@ -0,0 +1,93 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <thread>
+
+// counters for watching running guests from outside the process. every
+// thread that runs guests, or reads their input, owns one block and is its
+// only writer: counting is a plain load, add and store, with no lock and no
+// atomic read-modify-write. readers sum all blocks with relaxed loads while
+// the writers carry on.
+class alignas(64) Counters {
+public:
+  using Counter = std::atomic<uint64_t>;
+
+  Counter instructions{0};
+  Counter opcodes[16]{}; // instructions the switch engine ran, by opcode, if by_opcode
+  Counter traps[256]{};  // TRAPs, by vector
+  Counter exceptions{0}; // RES, and RTI without a guest OS
+  Counter kbsr_polls{0};
+  Counter syscalls{0};      // console writes, terminal polls and reads, input reads and waits
+  Counter input_wait_ns{0}; // guests blocked or parked until a key arrived
+
+  static auto add(Counter &counter, uint64_t n = 1) -> void {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  // the switch engine counts opcodes too, in loops of their own: set before
+  // any guest starts when metrics are served on a socket
+  static bool by_opcode;
+
+  // the calling thread's block, created on first use. blocks are never
+  // freed, so the totals keep what threads that have exited counted
+  static auto local() -> Counters &;
+
+  // every block so far, most recent first
+  static auto first() -> const Counters * { return head.load(std::memory_order_acquire); }
+  auto following() const -> const Counters * { return next; }
+
+private:
+  static std::atomic<Counters *> head;
+  Counters *next = nullptr;
+};
+
+// all blocks added up
+struct MetricsSnapshot {
+  uint64_t instructions = 0;
+  std::array<uint64_t, 16> opcodes{};
+  std::array<uint64_t, 256> traps{};
+  uint64_t exceptions = 0;
+  uint64_t kbsr_polls = 0;
+  uint64_t syscalls = 0;
+  uint64_t input_wait_ns = 0;
+  size_t threads = 0;
+};
+
+auto collect_metrics() -> MetricsSnapshot;
+
+// Prometheus text exposition format
+auto write_metrics(const MetricsSnapshot &metrics, std::ostream &out) -> void;
+
+// serves the totals from a background thread: a fresh snapshot to every
+// client of a Unix domain socket (as an HTTP response, so curl
+// --unix-socket and Prometheus can scrape it), and the same text on stderr
+// whenever the process receives SIGUSR1. without a socket path only the
+// signal is handled. one server per process; neither exists on Windows.
+class MetricsServer {
+public:
+  explicit MetricsServer(const char *socket_path = nullptr);
+  ~MetricsServer();
+
+  MetricsServer(const MetricsServer &) = delete;
+  auto operator=(const MetricsServer &) -> MetricsServer & = delete;
+
+  // false if the socket could not be set up
+  auto ok() const -> bool { return path.empty() || listener >= 0; }
+
+private:
+  auto serve() -> void;
+  auto answer(int client) -> void;
+
+  std::string path;
+  int listener = -1;
+  int wake_pipe[2] = {-1, -1}; // SIGUSR1 and shutdown
+  std::thread thread;
+};
+
+#endif // __METRICS_H__
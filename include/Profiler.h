@@ -0,0 +1,77 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class VM;
+
+// per-PC execution profile of a guest run on the switch engine. counts every
+// address, opcode and trap vector, the taken/not-taken edges of each BR and
+// the calls of each subroutine, and keeps a call tree built from JSR/JSRR
+// and RET (JMP R7) for flamegraph-style folded stacks.
+class Profiler {
+public:
+  // reports go to these files when write() is called: "-" is stderr, an
+  // empty path skips that report
+  Profiler(std::string report_path, std::string folded_path);
+
+  Profiler(const Profiler &) = delete;
+  auto operator=(const Profiler &) -> Profiler & = delete;
+
+  // accounts the instruction at `pc` once it has executed on `vm`
+  auto record(const VM &vm, uint16_t pc, uint16_t instruction) -> void;
+
+  // hottest addresses, loops, subroutines and branches, `top` of each
+  auto report(std::ostream &out, size_t top = 20) const -> void;
+
+  // one "caller;callee;... count" line per call path, for flamegraph.pl
+  auto folded(std::ostream &out) const -> void;
+
+  auto write() const -> void;
+
+private:
+  struct Branch {
+    uint16_t target = 0;
+    uint64_t taken = 0;
+    uint64_t not_taken = 0;
+  };
+
+  // a call path: frames are subroutine addresses, or trap_frame | vector
+  struct Node {
+    uint32_t frame;
+    uint32_t parent;
+    uint64_t self = 0; // instructions executed with exactly this path
+  };
+
+  static constexpr uint32_t trap_frame = 1 << 16;
+  // guests that leave subroutines without RET would grow the tree forever
+  static constexpr size_t max_depth = 64;
+
+  auto child(uint32_t parent, uint32_t frame) -> uint32_t;
+  auto call(uint16_t target, uint16_t return_address) -> void;
+  auto ret(uint16_t target) -> void;
+  auto path(uint32_t node) const -> std::string;
+
+  std::string report_path;
+  std::string folded_path;
+
+  uint64_t total = 0;
+  std::vector<uint64_t> executions; // per address
+  std::array<uint64_t, 16> opcodes{};
+  std::array<uint64_t, 256> traps{};
+  std::unordered_map<uint16_t, Branch> branches;
+  std::unordered_map<uint16_t, uint64_t> calls; // by subroutine address
+
+  std::vector<Node> nodes;
+  std::unordered_map<uint64_t, uint32_t> children; // (parent, frame) -> node
+  std::vector<std::pair<uint32_t, uint16_t>> stack; // caller node, return address
+  uint32_t current = 0;
+};
+
+#endif // __PROFILER_H__
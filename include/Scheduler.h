@@ -0,0 +1,64 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class VM;
+
+// many guests on a few threads: each worker takes the next runnable guest,
+// runs it for one slice of `slice` instructions and queues it again, round
+// robin. a guest waiting for a key is parked rather than queued, and costs
+// nothing until one I/O thread, polling every guest's input at once, feeds
+// it a key. output is buffered and flushed whenever a guest parks or halts.
+class Scheduler {
+public:
+  struct Stats {
+    uint64_t slices = 0;
+    uint64_t parks = 0;        // times a guest waited for input
+    uint64_t instructions = 0; // retired by all guests together
+  };
+
+  Scheduler(unsigned threads, uint64_t slice);
+  ~Scheduler();
+
+  Scheduler(const Scheduler &) = delete;
+  auto operator=(const Scheduler &) -> Scheduler & = delete;
+
+  // the guest runs from PC_START once run() is called. its keyboard reads
+  // from input_fd, which should be non-blocking (-1: no input at all); the
+  // caller keeps the descriptor and the VM's output file open until run()
+  // returns
+  auto add(std::unique_ptr<VM> vm, int input_fd) -> void;
+
+  // runs every guest until all of them have halted
+  auto run() -> Stats;
+
+private:
+  struct Guest;
+
+  auto worker() -> void;
+  auto io() -> void;
+  auto wake_io() -> void;
+  auto unpark(Guest &guest) -> void; // with the lock held
+
+  unsigned thread_count;
+  uint64_t slice;
+  std::vector<std::unique_ptr<Guest>> guests;
+
+  std::mutex lock; // runnable, live and every guest's parked/done flags
+  std::condition_variable work;
+  std::deque<Guest *> runnable;
+  size_t live = 0;
+
+  std::atomic<uint64_t> slices{0};
+  std::atomic<uint64_t> parks{0};
+  int wake_pipe[2] = {-1, -1};
+};
+
+#endif // __SCHEDULER_H__
@@ -0,0 +1,35 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <cstddef>
+#include <cstdint>
+
+class VM;
+
+// a VM's memory and registers saved mid-run, so that guests can skip the
+// boot code they would otherwise replay. VM::read_image accepts snapshots
+// in place of .obj images; the VM then resumes where the snapshot was taken,
+// and copies of it (forks) resume there too. input consumed and output
+// written before the snapshot are not part of it.
+//
+// file layout, big-endian like .obj images:
+//   "LC3SNAP" plus a version byte
+//   R_COUNT registers
+//   64-bit map of the 1024-word pages that are present; the others are zero
+//   the words of every present page, in address order
+namespace SnapshotFormat {
+constexpr char magic[8] = {'L', 'C', '3', 'S', 'N', 'A', 'P', 1};
+constexpr uint32_t page_words = 1024;
+constexpr uint32_t pages = (1 << 16) / page_words;
+} // namespace SnapshotFormat
+
+auto save_snapshot(const VM &vm, const char *path) -> bool;
+
+// the file contents start with the snapshot magic
+auto is_snapshot(const uint8_t *bytes, size_t size) -> bool;
+
+// replaces vm's memory and registers with those of a snapshot file's
+// contents and makes its next start() resume
+auto read_snapshot(VM &vm, const uint8_t *bytes, size_t size) -> bool;
+
+#endif // __SNAPSHOT_H__
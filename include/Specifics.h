@@ -2,7 +2,10 @@
 #define __SPECIFICS_H__
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <vector>
 
 #if defined(_WIN32) || defined(_WIN64)
 
@@ -15,6 +18,11 @@ auto restore_input_buffering() -> void;
 
 auto check_key() -> uint16_t;
 
+auto is_terminal(std::FILE *file) -> bool;
+
+// getc without stdio's locking, for a stream only one thread reads
+auto read_char(std::FILE *file) -> int;
+
 #elif defined(__linux__) || defined(__unix__)
 
 #include <fcntl.h>
@@ -31,6 +39,33 @@ auto restore_input_buffering() -> void;
 
 auto check_key() -> uint16_t;
 
+auto is_terminal(std::FILE *file) -> bool;
+
+// getc without stdio's locking, for a stream only one thread reads
+auto read_char(std::FILE *file) -> int;
+
 #endif
 
+// a whole file, read-only: memory-mapped where the platform and the file
+// allow it, read into memory otherwise
+class FileView {
+public:
+  explicit FileView(const char *path);
+  ~FileView();
+
+  FileView(const FileView &) = delete;
+  auto operator=(const FileView &) -> FileView & = delete;
+
+  auto ok() const -> bool { return opened; }
+  auto data() const -> const uint8_t * { return bytes; }
+  auto size() const -> size_t { return length; }
+
+private:
+  bool opened = false;
+  const uint8_t *bytes = nullptr;
+  size_t length = 0;
+  void *mapping = nullptr;
+  std::vector<uint8_t> copy; // the contents, when not mapped
+};
+
 #endif // __SPECIFICS_H__
\ No newline at end of file
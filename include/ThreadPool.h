@@ -0,0 +1,55 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// work-stealing pool: every worker owns a deque, pops its own work LIFO and
+// steals FIFO from the others once it runs dry.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(unsigned thread_count = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  auto operator=(const ThreadPool &) -> ThreadPool & = delete;
+
+  auto submit(Task task) -> void;
+
+  // blocks until every submitted task has finished
+  auto wait() -> void;
+
+  auto size() const -> unsigned { return static_cast<unsigned>(workers.size()); }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  auto worker(unsigned id) -> void;
+  auto take(unsigned id, Task &task) -> bool;
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+
+  std::atomic<unsigned> next_queue{0};
+  std::atomic<size_t> queued{0};  // submitted, not yet taken
+  std::atomic<size_t> pending{0}; // submitted, not yet finished
+
+  std::mutex state_lock;
+  std::condition_variable work_ready;
+  std::condition_variable all_done;
+  bool stopping = false;
+};
+
+#endif // __THREADPOOL_H__
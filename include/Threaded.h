@@ -0,0 +1,99 @@
+#ifndef __THREADED_H__
+#define __THREADED_H__
+
+#include <cstdint>
+#include <iosfwd>
+
+class VM;
+
+// one pre-decoded instruction. operands are unpacked and sign-extended once,
+// and pc-relative offsets are folded into absolute addresses since every
+// entry belongs to exactly one address.
+struct Decoded {
+  uint8_t handler; // index into the dispatch table
+  uint8_t r0;      // DR / SR, or the nzp mask of a branch
+  uint8_t r1;      // SR1 / BaseR
+  uint8_t r2;      // SR2
+  uint16_t imm;    // imm5 / offset6 / absolute target / trap vector
+  uint16_t raw;    // the original instruction word, or a fused operand
+};
+
+// an entry depends on at most this many words starting at its own address
+// (fusions and flag elision read ahead); stores invalidate every entry that
+// may cover them
+constexpr uint16_t DECODE_WINDOW = 4;
+
+namespace Handlers {
+constexpr uint8_t DECODE = 0; // not decoded yet, or invalidated by a store
+constexpr uint8_t ADD_REG = 1;
+constexpr uint8_t ADD_IMM = 2;
+constexpr uint8_t AND_REG = 3;
+constexpr uint8_t AND_IMM = 4;
+constexpr uint8_t NOT = 5;
+constexpr uint8_t BR = 6;
+constexpr uint8_t BR_ALWAYS = 7;
+constexpr uint8_t NOP = 8;
+constexpr uint8_t JMP = 9;
+constexpr uint8_t JSR = 10;
+constexpr uint8_t JSRR = 11;
+constexpr uint8_t LD = 12;
+constexpr uint8_t LDI = 13;
+constexpr uint8_t LDR = 14;
+constexpr uint8_t LEA = 15;
+constexpr uint8_t ST = 16;
+constexpr uint8_t STI = 17;
+constexpr uint8_t STR = 18;
+constexpr uint8_t TRAP = 19;
+constexpr uint8_t OTHER = 20; // RTI / RES, handled like the switch engine does
+// flag writers whose flags are dead, see elide_flags
+constexpr uint8_t ADD_REG_NF = 21;
+constexpr uint8_t ADD_IMM_NF = 22;
+constexpr uint8_t AND_REG_NF = 23;
+constexpr uint8_t AND_IMM_NF = 24;
+constexpr uint8_t NOT_NF = 25;
+constexpr uint8_t LEA_NF = 26;
+// superinstructions, see fuse
+constexpr uint8_t CONST = 27;       // AND Rx,Ry,#0; ADD Rx,Rx,#imm (imm)
+constexpr uint8_t ADD_BR = 28;      // ADD imm; BR (r2 = nzp, raw = target)
+constexpr uint8_t LDR_ADD_STR = 29; // r2 = the ADD immediate
+constexpr uint8_t LEA_PUTS = 30;    // LEA R0; TRAP x22 (raw = the TRAP)
+constexpr uint8_t COUNT = 31;
+} // namespace Handlers
+
+namespace Fusions {
+constexpr int CONST = 0;
+constexpr int ADD_BR = 1;
+constexpr int LDR_ADD_STR = 2;
+constexpr int LEA_PUTS = 3;
+constexpr int COUNT = 4;
+} // namespace Fusions
+
+auto decode(uint16_t address, uint16_t instruction) -> Decoded;
+
+auto writes_flags(const Decoded &d) -> bool;
+
+// switches `d`, decoded at `address`, to its no-flags variant when the
+// instructions after it overwrite the flags before any can read them
+auto elide_flags(Decoded &d, uint16_t address, const uint16_t *memory) -> void;
+
+// peephole over the words following `address`: turns `d` into a
+// superinstruction when it starts a recognised sequence
+auto fuse(Decoded &d, uint16_t address, const uint16_t *memory) -> void;
+
+// how often each superinstruction ran, over every run_fused so far
+auto report_fusions(std::ostream &out) -> void;
+
+// direct-threaded engine: executes from a per-address table of decoded
+// instructions, filled lazily and invalidated by VM::write_mem.
+auto run_threaded(VM &vm) -> void;
+
+// run_threaded with lazy condition codes: R_COND is derived from the last
+// result only at BR, TRAP and exit, and dead flag updates are not executed.
+// a store invalidates the entries before it too, whose flags depend on it.
+auto run_lazy(VM &vm) -> void;
+
+// run_lazy plus superinstructions: common two- and three-instruction idioms
+// execute as a single handler
+auto run_fused(VM &vm) -> void;
+
+#endif // __THREADED_H__
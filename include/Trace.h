@@ -0,0 +1,185 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "LC3.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iosfwd>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// bytes handed to a background thread that writes them to `out`. the guest
+// fills one buffer at a time; at most `buffers` full ones wait for the
+// writer before the guest has to wait too.
+class TraceWriter {
+public:
+  static constexpr size_t buffer_size = 1 << 16;
+
+  explicit TraceWriter(std::FILE *out, size_t buffers = 16);
+  ~TraceWriter();
+
+  TraceWriter(const TraceWriter &) = delete;
+  auto operator=(const TraceWriter &) -> TraceWriter & = delete;
+
+  auto byte(uint8_t value) -> void {
+    if (used == buffer_size)
+      hand_off();
+    active[used++] = value;
+  }
+
+  // LEB128: 7 bits per byte, low bits first
+  auto varint(uint64_t value) -> void {
+    for (; value >= 0x80; value >>= 7)
+      byte(static_cast<uint8_t>(value | 0x80));
+    byte(static_cast<uint8_t>(value));
+  }
+
+  auto bytes(const void *data, size_t size) -> void;
+
+  // writes out everything so far and waits until it is on disk
+  auto flush() -> void;
+
+private:
+  using Buffer = std::unique_ptr<uint8_t[]>;
+
+  auto hand_off() -> void;
+  auto writer() -> void;
+
+  std::FILE *out;
+  size_t limit;
+  Buffer active;
+  size_t used = 0;
+
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<std::pair<Buffer, size_t>> full;
+  std::vector<Buffer> spare;
+  bool writing = false;
+  bool stopping = false;
+  std::thread thread;
+};
+
+// the nondeterministic inputs of a run, in the order the guest saw them:
+// keyboard polls, keys read and timer readings. with the image they are
+// all a replay needs, whatever engine recorded them, since every engine
+// executes the same instructions in the same order. polls with the same
+// result in a row are stored as one run, so a guest spinning on KBSR
+// costs a few bytes per key.
+//
+// log layout: "LC3RECD" plus a version byte, a varint hash of the initial
+// memory and registers, then one tag byte per event with varint operands,
+// and an end event with the final instruction count and registers.
+namespace RecordFormat {
+constexpr char magic[8] = {'L', 'C', '3', 'R', 'E', 'C', 'D', 1};
+constexpr uint8_t POLL_EMPTY = 0; // varint count
+constexpr uint8_t POLL_READY = 1; // varint count
+constexpr uint8_t KEY = 2;        // varint character (0xffff: end of input)
+constexpr uint8_t TIMER = 3;      // varint milliseconds
+constexpr uint8_t END = 4;        // varint retired, R_COUNT varint registers
+constexpr uint8_t STOP = 5;       // the input ended and the guest was stopped
+} // namespace RecordFormat
+
+auto state_hash(const VM &vm) -> uint64_t;
+
+class Recorder {
+public:
+  // `vm` is loaded and about to start
+  Recorder(std::FILE *out, const VM &vm);
+
+  auto poll(uint16_t ready) -> void {
+    if (run_count && ready == run_value) {
+      ++run_count;
+      return;
+    }
+    end_run();
+    run_value = ready;
+    run_count = 1;
+  }
+  auto key(uint16_t c) -> void;
+  auto timer(uint16_t ms) -> void;
+  auto stop() -> void;
+
+  // the end event; the log is complete once this has returned. a run
+  // stopped by SIGINT ends between two instructions, so it is finished the
+  // same way, on the thread that ran it
+  auto finish(const VM &vm) -> void;
+
+private:
+  auto end_run() -> void;
+
+  TraceWriter writer;
+  uint16_t run_value = 0;
+  uint64_t run_count = 0;
+  bool finished = false;
+};
+
+// feeds a recorded log back to a guest in place of its inputs. a guest
+// asking for another kind of input than the log holds, or for input beyond
+// its end, has diverged and is stopped.
+class Replayer {
+public:
+  // false, with a reason in `error`, if the log cannot be read
+  auto open(const char *path, std::string &error) -> bool;
+
+  // the log was recorded from this initial state
+  auto matches(const VM &vm) const -> bool { return hash == state_hash(vm); }
+
+  // the instructions of the recorded run, from its end event: a run stopped
+  // by SIGINT has to stop there too. the largest count if the log has none
+  auto recorded_length() const -> uint64_t { return length; }
+
+  auto poll(VM &vm) -> uint16_t;
+  auto key(VM &vm) -> uint16_t;
+  auto timer(VM &vm) -> uint16_t;
+
+  // the log's end event agrees with the final state of `vm`
+  auto verify(const VM &vm, std::string &error) const -> bool;
+
+  auto diverged() const -> bool { return failed; }
+
+private:
+  auto next(VM &vm, uint8_t tag) -> bool;
+  auto stop_if_recorded(VM &vm) -> void;
+  auto read_varint() -> uint64_t;
+
+  std::vector<uint8_t> log;
+  size_t position = 0;
+  uint64_t hash = 0;
+  uint64_t length = std::numeric_limits<uint64_t>::max();
+  uint8_t run_tag = 0;
+  uint64_t run_left = 0;
+  uint64_t operand = 0;
+  bool failed = false;
+};
+
+// the full instruction trace of a run: for every retired instruction its
+// PC (stored only where it does not follow the previous one), the registers
+// it changed and the word it stored, if any.
+//
+// trace layout: "LC3TRCE" plus a version byte, a varint start PC, then per
+// instruction a tag byte (bit 0: varint PC follows, bit 1: varint address
+// and value of a store follow, bit 2: a byte mask of changed registers R0-R7
+// follows, then a varint value for each).
+namespace TraceFormat {
+constexpr char magic[8] = {'L', 'C', '3', 'T', 'R', 'C', 'E', 1};
+constexpr uint8_t JUMP = 1 << 0;
+constexpr uint8_t STORE = 1 << 1;
+constexpr uint8_t REGS = 1 << 2;
+} // namespace TraceFormat
+
+// runs vm on VM::step until it stops or has retired `until` instructions,
+// writing every instruction to `out`
+auto run_traced(VM &vm, TraceWriter &out, uint64_t until) -> void;
+
+// the trace as text, one instruction per line
+auto dump_trace(const char *path, std::ostream &out) -> bool;
+
+#endif // __TRACE_H__
@@ -0,0 +1,357 @@
+#include "AOT.h"
+#include "LC3.h"
+#include "Threaded.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <process.h>
+#else
+#include <spawn.h>
+#include <sys/wait.h>
+extern char **environ;
+#endif
+
+using std::map;
+using std::ostream;
+using std::set;
+using std::string;
+using std::vector;
+
+// where the generated program finds the interpreter library; set by CMake
+#ifndef LC3VM_CXX
+#define LC3VM_CXX "c++"
+#endif
+#ifndef LC3VM_INCLUDE_DIR
+#define LC3VM_INCLUDE_DIR "include"
+#endif
+#ifndef LC3VM_LIBRARY
+#define LC3VM_LIBRARY "liblc3core.a"
+#endif
+
+namespace {
+
+
+struct Image {
+  uint16_t origin = 0;
+  vector<uint16_t> words;
+
+  auto contains(uint16_t address) const -> bool {
+    return address >= origin && static_cast<size_t>(address - origin) < words.size();
+  }
+
+  auto at(uint16_t address) const -> uint16_t { return words[address - origin]; }
+};
+
+auto load(const char *image_path, Image &image) -> bool {
+  std::ifstream file(image_path, std::ios::binary);
+  if (!file)
+    return false;
+
+  vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  if (bytes.size() < 2)
+    return false;
+
+  image.origin = static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+  size_t count = (bytes.size() - 2) / 2;
+  if (count > VM::memory_size - image.origin)
+    count = VM::memory_size - image.origin;
+  for (size_t i = 0; i < count; ++i)
+    image.words.push_back(static_cast<uint16_t>(bytes[2 + 2 * i] << 8 | bytes[3 + 2 * i]));
+  return true;
+}
+
+auto ends_block(const Decoded &d) -> bool {
+  switch (d.handler) {
+  case Handlers::BR:
+  case Handlers::BR_ALWAYS:
+  case Handlers::JMP:
+  case Handlers::JSR:
+  case Handlers::JSRR:
+  case Handlers::TRAP:
+  case Handlers::OTHER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// block leaders reachable from PC_START, following every static edge and
+// treating the instruction after a call or trap as a return point
+auto find_leaders(const Image &image) -> set<uint16_t> {
+  set<uint16_t> leaders, visited;
+  vector<uint16_t> work{VM::PC_START};
+
+  while (!work.empty()) {
+    uint16_t pc = work.back();
+    work.pop_back();
+    if (!image.contains(pc) || !leaders.insert(pc).second)
+      continue;
+
+    for (;; ++pc) {
+      if (!image.contains(pc) || !visited.insert(pc).second)
+        break;
+
+      Decoded d = decode(pc, image.at(pc));
+      uint16_t next = pc + 1;
+      if (d.handler == Handlers::BR || d.handler == Handlers::BR_ALWAYS ||
+          d.handler == Handlers::JSR)
+        work.push_back(d.imm);
+      if (ends_block(d)) {
+        if (d.handler != Handlers::BR_ALWAYS && d.handler != Handlers::JMP)
+          work.push_back(next);
+        break;
+      }
+    }
+  }
+  return leaders;
+}
+
+auto hex(uint16_t value) -> string {
+  std::ostringstream s;
+  s << "0x" << std::hex << std::setw(4) << std::setfill('0') << value;
+  return s.str();
+}
+
+auto label(uint16_t start) -> string { return "b_" + hex(start).substr(2); }
+
+auto reg(int r) -> string { return "r[" + std::to_string(r) + "]"; }
+
+class Generator {
+public:
+  Generator(const Image &image, ostream &out) : image(image), o(out) {}
+
+  auto run() -> void {
+    auto leaders = find_leaders(image);
+
+    o << "// generated by LC3VM --aot; do not edit\n"
+         "#include \"AOT.h\"\n"
+         "#include \"LC3.h\"\n\n"
+         "namespace {\n"
+         "using namespace Registers;\n";
+
+    map<uint16_t, uint16_t> lengths;
+    for (auto it = leaders.begin(); it != leaders.end(); ++it) {
+      auto next_leader = std::next(it);
+      lengths[*it] = block(*it, next_leader == leaders.end() ? -1 : *next_leader);
+    }
+
+    o << "\nconst uint16_t image[] = {";
+    for (size_t i = 0; i < image.words.size(); ++i)
+      o << (i % 12 ? " " : "\n    ") << hex(image.words[i]) << ",";
+    o << "};\n\nconst AotBlock blocks[] = {\n";
+    for (auto [start, length] : lengths)
+      o << "    {" << hex(start) << ", " << length << ", " << label(start) << "},\n";
+    o << "};\n} // namespace\n\n"
+         "auto main(int argc, const char *argv[]) -> int {\n"
+         "  AotProgram program{"
+      << hex(image.origin)
+      << ", image, sizeof image / sizeof *image, blocks,\n"
+         "                     sizeof blocks / sizeof *blocks};\n"
+         "  return aot_main(argc, argv, program);\n"
+         "}\n";
+  }
+
+private:
+  // emits the block starting at `start`; returns the number of words it covers
+  auto block(uint16_t start, int next_leader) -> uint16_t {
+    o << "\nauto " << label(start) << "(VM &vm) -> uint16_t {\n"
+      << "  auto &r = vm.registers;\n";
+
+    uint16_t pc = start;
+    int count = 0;
+    for (;;) {
+      Decoded d = decode(pc, image.at(pc));
+      uint16_t next = pc + 1;
+      ++count;
+      o << "  // " << hex(pc) << ": " << hex(d.raw) << "\n";
+      if (instruction(d, next, count))
+        break;
+      pc = next;
+      if (pc == next_leader || !image.contains(pc)) {
+        leave(count, hex(pc));
+        break;
+      }
+    }
+    o << "}\n";
+    return static_cast<uint16_t>(count);
+  }
+
+  auto leave(int count, const string &target) -> void {
+    o << "  vm.retired += " << count << ";\n  return " << target << ";\n";
+  }
+
+  auto leave_if(const char *condition, int count, uint16_t next) -> void {
+    o << "  if (" << condition << ") {\n    vm.retired += " << count
+      << ";\n    return " << hex(next) << ";\n  }\n";
+  }
+
+  auto set_cc(int r) -> void { o << "  r[R_COND] = flags_of(" << reg(r) << ");\n"; }
+
+  // loads go through read_mem only where a device may answer
+  auto load(int dst, const string &address, bool may_be_device, int count, uint16_t next) -> void {
+    if (may_be_device) {
+      o << "  " << reg(dst) << " = vm.read_mem(" << address << ");\n";
+      set_cc(dst);
+      leave_if("!vm.is_running", count, next);
+    } else {
+      o << "  " << reg(dst) << " = vm.memory[" << address << "];\n";
+      set_cc(dst);
+    }
+  }
+
+  auto store(const string &address, int src, int count, uint16_t next) -> void {
+    o << "  vm.write_mem(" << address << ", " << reg(src) << ");\n";
+    leave_if("vm.code_dirty || !vm.is_running", count, next);
+  }
+
+  // emits one instruction; returns true when it ends the block
+  auto instruction(const Decoded &d, uint16_t next, int count) -> bool {
+    auto imm = hex(d.imm);
+    auto sum = "static_cast<uint16_t>(" + reg(d.r1) + " + " + imm + ")";
+
+    switch (d.handler) {
+    case Handlers::ADD_REG:
+      o << "  " << reg(d.r0) << " = " << reg(d.r1) << " + " << reg(d.r2) << ";\n";
+      set_cc(d.r0);
+      return false;
+    case Handlers::ADD_IMM:
+      o << "  " << reg(d.r0) << " = " << sum << ";\n";
+      set_cc(d.r0);
+      return false;
+    case Handlers::AND_REG:
+      o << "  " << reg(d.r0) << " = " << reg(d.r1) << " & " << reg(d.r2) << ";\n";
+      set_cc(d.r0);
+      return false;
+    case Handlers::AND_IMM:
+      o << "  " << reg(d.r0) << " = " << reg(d.r1) << " & " << imm << ";\n";
+      set_cc(d.r0);
+      return false;
+    case Handlers::NOT:
+      o << "  " << reg(d.r0) << " = ~" << reg(d.r1) << ";\n";
+      set_cc(d.r0);
+      return false;
+    case Handlers::LEA:
+      o << "  " << reg(d.r0) << " = " << imm << ";\n";
+      set_cc(d.r0);
+      return false;
+    case Handlers::LD:
+      load(d.r0, imm, d.imm >= MappedReg::IO_PAGE, count, next);
+      return false;
+    case Handlers::LDR:
+      load(d.r0, sum, true, count, next);
+      return false;
+    case Handlers::LDI:
+      load(d.r0, "vm.read_mem(" + imm + ")", true, count, next);
+      return false;
+    case Handlers::ST:
+      store(imm, d.r0, count, next);
+      return false;
+    case Handlers::STR:
+      store(sum, d.r0, count, next);
+      return false;
+    case Handlers::STI:
+      store("vm.read_mem(" + imm + ")", d.r0, count, next);
+      return false;
+    case Handlers::NOP:
+      return false;
+    case Handlers::BR:
+      o << "  vm.retired += " << count << ";\n"
+        << "  return r[R_COND] & " << int(d.r0) << " ? " << imm << " : " << hex(next) << ";\n";
+      return true;
+    case Handlers::BR_ALWAYS:
+      leave(count, imm);
+      return true;
+    case Handlers::JMP:
+      leave(count, reg(d.r1));
+      return true;
+    case Handlers::JSR:
+      o << "  r[R_R7] = " << hex(next) << ";\n";
+      leave(count, imm);
+      return true;
+    case Handlers::JSRR:
+      o << "  uint16_t target = " << reg(d.r1) << ";\n"
+        << "  r[R_R7] = " << hex(next) << ";\n";
+      leave(count, "target");
+      return true;
+    default: // TRAP, RTI, RES: same handler as the interpreter, which may
+             // continue in a guest routine
+      o << "  r[R_PC] = " << hex(next) << ";\n"
+        << "  vm.trap_routines(" << hex(d.raw) << ");\n";
+      leave(count, "r[R_PC]");
+      return true;
+    }
+  }
+
+  const Image &image;
+  ostream &o;
+};
+
+// runs the command directly, without a shell, so that no path is ever
+// parsed as shell syntax
+auto run_command(const vector<string> &args) -> bool {
+  vector<char *> argv;
+  for (const auto &arg : args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+#if defined(_WIN32) || defined(_WIN64)
+  return _spawnvp(_P_WAIT, argv[0], argv.data()) == 0;
+#else
+  pid_t pid;
+  if (posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ) != 0)
+    return false;
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return false;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+} // namespace
+
+auto aot_translate(const char *image_path, ostream &out) -> bool {
+  Image image;
+  if (!load(image_path, image))
+    return false;
+
+  Generator(image, out).run();
+  return true;
+}
+
+auto aot_compile(const char *image_path, const char *output_path, bool emit_cpp) -> int {
+  string source = emit_cpp ? string(output_path) : string(output_path) + ".cpp";
+  {
+    std::ofstream out(source);
+    if (!out || !aot_translate(image_path, out)) {
+      std::cerr << "failed to translate image: " << image_path << '\n';
+      return 1;
+    }
+  }
+  if (emit_cpp)
+    return 0;
+
+  const char *cxx = std::getenv("CXX");
+  vector<string> command = {cxx ? cxx : LC3VM_CXX, "-std=c++20", "-O2", "-I" LC3VM_INCLUDE_DIR,
+                            source, LC3VM_LIBRARY, "-lpthread", "-o", output_path};
+  bool compiled = run_command(command);
+  std::remove(source.c_str());
+  if (!compiled) {
+    std::cerr << "failed to compile translation:";
+    for (const auto &arg : command)
+      std::cerr << ' ' << arg;
+    std::cerr << '\n';
+    return 1;
+  }
+  return 0;
+}
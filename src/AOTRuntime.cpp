@@ -0,0 +1,115 @@
+#include "AOT.h"
+#include "LC3.h"
+#include "Specifics.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using std::array;
+using std::unique_ptr;
+
+// a block stays valid only while its words still match the translated image
+static auto unchanged(const VM &vm, const AotProgram &program, const AotBlock &block) -> bool {
+  const uint16_t *original = program.image + (block.start - program.origin);
+  return std::equal(original, original + block.length, vm.memory.begin() + block.start);
+}
+
+auto run_aot(VM &vm, const AotProgram &program) -> void {
+  auto table = unique_ptr<aot_fn[]>(new aot_fn[VM::memory_size]());
+  auto code_map = std::make_unique<array<uint8_t, VM::memory_size>>();
+  for (size_t i = 0; i < program.block_count; ++i) {
+    const auto &block = program.blocks[i];
+    table[block.start] = block.run;
+    std::fill_n(code_map->begin() + block.start, block.length, 1);
+  }
+
+  auto &reg = vm.registers;
+  vm.start();
+  vm.code_map = code_map->data();
+
+  while (vm.is_running) {
+    if (aot_fn run = table[reg[Registers::R_PC]]) {
+      reg[Registers::R_PC] = run(vm);
+      if (interrupt_requested.load(std::memory_order_relaxed)) [[unlikely]]
+        vm.is_running = false;
+    } else {
+      vm.step();
+    }
+
+    if (vm.code_dirty) {
+      // code was written at runtime: retire the stale translations and let
+      // the interpreter run those addresses from now on
+      for (size_t i = 0; i < program.block_count; ++i)
+        if (table[program.blocks[i].start] && !unchanged(vm, program, program.blocks[i]))
+          table[program.blocks[i].start] = nullptr;
+      vm.code_dirty = false;
+    }
+  }
+  vm.code_map = nullptr;
+  vm.flush_output();
+  vm.publish();
+}
+
+// the console options of LC3VM's normal mode
+static auto aot_usage(const char *name) -> int {
+  std::cerr << name << " [--headless] [--input file] [--flush always|line|full] "
+                       "[--buffer bytes]\n";
+  return 2;
+}
+
+auto aot_main(int argc, const char *argv[], const AotProgram &program) -> int {
+  bool headless = false;
+  const char *input_path = nullptr;
+  Flush flush = Flush::Always;
+  bool flush_given = false;
+  size_t buffer = 1 << 20;
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--headless"))
+      headless = true;
+    else if (!std::strcmp(argv[i], "--input") && i + 1 < argc)
+      input_path = argv[++i];
+    else if (!std::strcmp(argv[i], "--flush") && i + 1 < argc) {
+      if (!parse_flush(argv[++i], flush))
+        return aot_usage(argv[0]);
+      flush_given = true;
+    } else if (!std::strcmp(argv[i], "--buffer") && i + 1 < argc)
+      buffer = std::stoul(argv[++i]);
+    else
+      return aot_usage(argv[0]);
+  }
+
+  auto vm = std::make_unique<VM>();
+  std::copy_n(program.image, program.image_size, vm->memory.begin() + program.origin);
+
+  // headless runs never touch the terminal and write output in large chunks
+  std::unique_ptr<std::FILE, decltype(&fclose)> input_file(nullptr, std::fclose);
+  if (input_path) {
+    input_file.reset(std::fopen(input_path, "rb"));
+    if (!input_file) {
+      std::cout << "failed to open input: " << input_path << '\n';
+      return 1;
+    }
+    vm->set_io(input_file.get(), stdout);
+  }
+  if (headless && !flush_given)
+    flush = Flush::Full;
+  vm->set_output_buffering(flush, buffer);
+
+  install_interrupt_handler();
+  if (!headless)
+    disable_input_buffering();
+
+  run_aot(*vm, program);
+
+  restore_input_buffering();
+  if (interrupt_requested) {
+    std::cout << '\n';
+    return -2;
+  }
+  return 0;
+}
@@ -0,0 +1,111 @@
+#include "Batch.h"
+#include "LC3.h"
+#include "Lockstep.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+
+using std::map;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+using file_ptr = unique_ptr<std::FILE, decltype(&fclose)>;
+
+static auto open_file(const string &path, const char *flags) -> file_ptr {
+  return file_ptr(path.empty() ? nullptr : std::fopen(path.c_str(), flags), std::fclose);
+}
+
+auto run_batch(const vector<BatchJob> &jobs, unsigned threads, Engine engine)
+    -> BatchResult {
+  BatchResult result;
+  result.jobs = jobs.size();
+
+  // load every image up front; workers only ever copy these
+  map<string, unique_ptr<VM>> images;
+  for (const auto &job : jobs) {
+    if (images.count(job.image))
+      continue;
+    auto vm = std::make_unique<VM>(nullptr, nullptr);
+    if (!vm->read_image(job.image.c_str())) {
+      std::cerr << "failed to load image: " << job.image << '\n';
+      result.failed = jobs.size();
+      return result;
+    }
+    images.emplace(job.image, std::move(vm));
+  }
+
+  std::atomic<size_t> failed{0};
+  std::atomic<uint64_t> instructions{0};
+  auto start = std::chrono::steady_clock::now();
+  {
+    ThreadPool pool(threads);
+    if (engine == Engine::Lockstep) {
+      // jobs of the same image share lanes, LOCKSTEP_LANES per task
+      map<string, vector<const BatchJob *>> by_image;
+      for (const auto &job : jobs)
+        by_image[job.image].push_back(&job);
+      for (const auto &[image, image_jobs] : by_image) {
+        const VM &prototype = *images.at(image);
+        for (size_t first = 0; first < image_jobs.size(); first += LOCKSTEP_LANES) {
+          vector<const BatchJob *> chunk(
+              image_jobs.begin() + first,
+              image_jobs.begin() + std::min(first + LOCKSTEP_LANES, image_jobs.size()));
+          pool.submit([chunk, &prototype, &failed, &instructions] {
+            vector<file_ptr> files;
+            vector<unique_ptr<VM>> vms;
+            vector<VM *> lanes;
+            for (const BatchJob *job : chunk) {
+              auto in = open_file(job->input, "rb");
+              auto out = open_file(job->output, "wb");
+              if ((!job->input.empty() && !in) || !out) {
+                failed++;
+                continue;
+              }
+              vms.push_back(std::make_unique<VM>(prototype));
+              vms.back()->set_io(in.get(), out.get());
+              vms.back()->set_output_buffering(Flush::Full);
+              lanes.push_back(vms.back().get());
+              files.push_back(std::move(in));
+              files.push_back(std::move(out));
+            }
+            run_lockstep(lanes.data(), lanes.size());
+            for (VM *vm : lanes)
+              instructions += vm->retired;
+          });
+        }
+      }
+    } else {
+      for (const auto &job : jobs) {
+        const VM &prototype = *images.at(job.image);
+        pool.submit([&job, &prototype, &failed, &instructions, engine] {
+          auto in = open_file(job.input, "rb");
+          auto out = open_file(job.output, "wb");
+          if ((!job.input.empty() && !in) || !out) {
+            failed++;
+            return;
+          }
+
+          auto vm = std::make_unique<VM>(prototype);
+          vm->set_io(in.get(), out.get());
+          vm->set_output_buffering(Flush::Full);
+          run(*vm, engine);
+          instructions += vm->retired;
+        });
+      }
+    }
+    pool.wait();
+  }
+  auto stop = std::chrono::steady_clock::now();
+
+  result.failed = failed;
+  result.instructions = instructions;
+  result.seconds = std::chrono::duration<double>(stop - start).count();
+  return result;
+}
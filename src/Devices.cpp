@@ -0,0 +1,60 @@
+#include "Devices.h"
+#include "LC3.h"
+
+#include <cstdio>
+
+auto Device::read(VM &vm, uint16_t address) -> uint16_t { return vm.memory[address]; }
+
+auto Device::write(VM &vm, uint16_t address, uint16_t value) -> void {
+  vm.memory[address] = value;
+}
+
+auto Keyboard::read(VM &vm, uint16_t address) -> uint16_t {
+  if (address == MappedReg::MR_KBSR) {
+    if (vm.poll_key()) {
+      vm.memory[MappedReg::MR_KBSR] = (1 << 15);
+      vm.memory[MappedReg::MR_KBDR] = vm.get_char();
+    } else {
+      vm.memory[MappedReg::MR_KBSR] = 0;
+    }
+  }
+  return vm.memory[address];
+}
+
+auto Display::read(VM &vm, uint16_t address) -> uint16_t {
+  return address == MappedReg::MR_DSR ? (1 << 15) : vm.memory[address];
+}
+
+auto Display::write(VM &vm, uint16_t address, uint16_t value) -> void {
+  vm.memory[address] = value;
+  if (address == MappedReg::MR_DDR) {
+    vm.put(static_cast<char>(value));
+    vm.end_output();
+  }
+}
+
+auto MachineControl::read(VM &vm, [[maybe_unused]] uint16_t address) -> uint16_t {
+  return vm.is_running ? (1 << 15) : 0;
+}
+
+auto MachineControl::write(VM &vm, uint16_t address, uint16_t value) -> void {
+  vm.memory[address] = value;
+  if (!(value & (1 << 15)))
+    vm.is_running = false;
+}
+
+auto Timer::read(VM &vm, [[maybe_unused]] uint16_t address) -> uint16_t { return vm.clock(); }
+
+auto attach_standard_devices(VM &vm) -> void {
+  static Keyboard keyboard;
+  static Display display;
+  static MachineControl machine_control;
+  static Timer timer;
+
+  vm.attach(MappedReg::MR_KBSR, &keyboard);
+  vm.attach(MappedReg::MR_KBDR, &keyboard);
+  vm.attach(MappedReg::MR_DSR, &display);
+  vm.attach(MappedReg::MR_DDR, &display);
+  vm.attach(MappedReg::MR_TMR, &timer);
+  vm.attach(MappedReg::MR_MCR, &machine_control);
+}
@@ -0,0 +1,70 @@
+#include "Engine.h"
+#include "JIT.h"
+#include "LC3.h"
+#include "Lockstep.h"
+#include "Threaded.h"
+
+#include <cstring>
+
+auto parse_engine(const char *name, Engine &engine) -> bool {
+  if (!std::strcmp(name, "switch"))
+    engine = Engine::Switch;
+  else if (!std::strcmp(name, "threaded"))
+    engine = Engine::Threaded;
+  else if (!std::strcmp(name, "lazy"))
+    engine = Engine::Lazy;
+  else if (!std::strcmp(name, "fused"))
+    engine = Engine::Fused;
+  else if (!std::strcmp(name, "jit"))
+    engine = Engine::JIT;
+  else if (!std::strcmp(name, "lockstep"))
+    engine = Engine::Lockstep;
+  else
+    return false;
+  return true;
+}
+
+auto engine_name(Engine engine) -> const char * {
+  switch (engine) {
+  case Engine::Switch:
+    return "switch";
+  case Engine::Threaded:
+    return "threaded";
+  case Engine::Lazy:
+    return "lazy";
+  case Engine::Fused:
+    return "fused";
+  case Engine::JIT:
+    return "jit";
+  case Engine::Lockstep:
+    return "lockstep";
+  }
+  return "unknown";
+}
+
+auto run(VM &vm, Engine engine) -> void {
+  switch (engine) {
+  case Engine::Switch:
+    vm.run_vm();
+    break;
+  case Engine::Threaded:
+    run_threaded(vm);
+    break;
+  case Engine::Lazy:
+    run_lazy(vm);
+    break;
+  case Engine::Fused:
+    run_fused(vm);
+    break;
+  case Engine::JIT:
+    run_jit(vm);
+    break;
+  case Engine::Lockstep: {
+    VM *one = &vm;
+    run_lockstep(&one, 1);
+  } break;
+  }
+  // the guest may stop without HALT (MCR, end of input)
+  vm.flush_output();
+  vm.publish();
+}
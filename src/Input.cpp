@@ -0,0 +1,138 @@
+#include "Input.h"
+#include "LC3.h"
+#include "Metrics.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+InputQueue::InputQueue(std::FILE *in, std::chrono::milliseconds idle_timeout)
+    : idle_timeout(idle_timeout), fd(fileno(in)) {
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (pipe(wake_pipe) != 0)
+    wake_pipe[0] = wake_pipe[1] = -1;
+#endif
+  thread = std::thread([this] { reader(); });
+}
+
+InputQueue::InputQueue() = default;
+
+InputQueue::~InputQueue() {
+  if (!thread.joinable())
+    return;
+  stopping = true;
+#if defined(_WIN32) || defined(_WIN64)
+  // a console read cannot be interrupted; the thread ends with the process
+  thread.detach();
+#else
+  if (wake_pipe[1] >= 0) {
+    char c = 0;
+    [[maybe_unused]] auto n = write(wake_pipe[1], &c, 1);
+    thread.join();
+    ::close(wake_pipe[0]);
+    ::close(wake_pipe[1]);
+  } else {
+    thread.detach();
+  }
+#endif
+}
+
+auto InputQueue::reader() -> void {
+  auto &counters = Counters::local();
+  char buffer[256];
+  while (!stopping) {
+#if defined(_WIN32) || defined(_WIN64)
+    int n = _read(fd, buffer, sizeof buffer);
+    Counters::add(counters.syscalls);
+#else
+    pollfd fds[3] = {{fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}, {interrupt_fd(), POLLIN, 0}};
+    if (::poll(fds, 3, -1) < 0 || fds[1].revents)
+      continue;
+    if (fds[2].revents) {
+      // SIGINT: a guest waiting for a key has to see it
+      std::lock_guard<std::mutex> guard(park_lock);
+      key_ready.notify_one();
+      return;
+    }
+    ssize_t n = read(fd, buffer, sizeof buffer);
+    Counters::add(counters.syscalls, 2);
+#endif
+    if (n <= 0) {
+      eof.store(true, std::memory_order_release);
+      n = 0;
+    }
+    for (int i = 0; i < n; ++i)
+      while (!ring.push(static_cast<uint8_t>(buffer[i])) && !stopping)
+        std::this_thread::yield(); // guest is not consuming; let it catch up
+
+    // once per read, not per key: a parked guest re-checks under this lock
+    {
+      std::lock_guard<std::mutex> guard(park_lock);
+      key_ready.notify_one();
+    }
+    if (eof)
+      return;
+  }
+}
+
+auto InputQueue::feed(const char *keys, size_t count) -> size_t {
+  size_t fed = 0;
+  while (fed < count && ring.push(static_cast<uint8_t>(keys[fed])))
+    ++fed;
+  if (fed) {
+    std::lock_guard<std::mutex> guard(park_lock);
+    key_ready.notify_one();
+  }
+  return fed;
+}
+
+auto InputQueue::close() -> void {
+  eof.store(true, std::memory_order_release);
+  std::lock_guard<std::mutex> guard(park_lock);
+  key_ready.notify_one();
+}
+
+auto InputQueue::wait_for_key(bool bounded) -> void {
+  auto begin = std::chrono::steady_clock::now();
+  {
+    std::unique_lock<std::mutex> guard(park_lock);
+    auto ready = [this] {
+      return !ring.empty() || eof.load(std::memory_order_acquire) || interrupt_requested;
+    };
+    if (bounded)
+      key_ready.wait_for(guard, idle_timeout, ready);
+    else
+      key_ready.wait(guard, ready);
+  }
+  auto &counters = Counters::local();
+  Counters::add(counters.syscalls); // the futex wait
+  Counters::add(counters.input_wait_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                            std::chrono::steady_clock::now() - begin)
+                                            .count());
+}
+
+auto InputQueue::poll() -> bool {
+  if (!ring.empty()) {
+    misses = 0;
+    return true;
+  }
+  if (++misses >= spin_polls && idle_timeout.count() > 0 && !eof) {
+    wait_for_key(true);
+    misses = 0;
+  }
+  return !ring.empty();
+}
+
+auto InputQueue::pop() -> int {
+  uint8_t c;
+  while (!ring.pop(c)) {
+    if (exhausted() || interrupt_requested)
+      return EOF;
+    wait_for_key(false);
+  }
+  misses = 0;
+  return c;
+}
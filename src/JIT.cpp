@@ -0,0 +1,510 @@
+#include "JIT.h"
+#include "LC3.h"
+#include "Threaded.h"
+
+#include <cstdint>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__unix__))
+
+#include <sys/mman.h>
+
+#include <array>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+using std::array;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+auto jit_supported() -> bool { return true; }
+
+namespace {
+
+// translated code keeps the guest state in host registers:
+//   rbx = VM::registers, r12 = VM::memory, r13 = &retired, r14 = code map
+// a block returns the next guest PC in eax; bit 16 set means "interpret the
+// instruction at that PC before translating again".
+constexpr uint32_t INTERPRET = 1 << 16;
+constexpr size_t CODE_SIZE = 8 << 20;
+constexpr size_t CODE_SLACK = 16 << 10; // room always left for one block
+constexpr int MAX_BLOCK = 64;
+
+using entry_fn = uint32_t (*)(uint16_t *regs, uint16_t *memory,
+                              uint64_t *retired, const uint8_t *code_map,
+                              const uint8_t *block);
+
+class Emitter {
+public:
+  explicit Emitter(uint8_t *at) : p(at) {}
+
+  auto here() const -> uint8_t * { return p; }
+
+  auto byte(uint8_t b) -> void { *p++ = b; }
+
+  auto bytes(std::initializer_list<uint8_t> bs) -> void {
+    for (auto b : bs)
+      byte(b);
+  }
+
+  auto imm16(uint16_t v) -> void {
+    std::memcpy(p, &v, 2);
+    p += 2;
+  }
+
+  auto imm32(uint32_t v) -> void {
+    std::memcpy(p, &v, 4);
+    p += 4;
+  }
+
+  // host reg 0 = eax, 1 = ecx, 2 = edx
+  auto load_reg(int host, int guest) -> void { // movzx e?x, word [rbx + 2*guest]
+    bytes({0x0F, 0xB7, static_cast<uint8_t>(0x43 | host << 3),
+           static_cast<uint8_t>(guest * 2)});
+  }
+
+  auto store_reg(int guest, int host) -> void { // mov word [rbx + 2*guest], ?x
+    bytes({0x66, 0x89, static_cast<uint8_t>(0x43 | host << 3),
+           static_cast<uint8_t>(guest * 2)});
+  }
+
+  auto store_reg_imm(int guest, uint16_t value) -> void {
+    bytes({0x66, 0xC7, 0x43, static_cast<uint8_t>(guest * 2)});
+    imm16(value);
+  }
+
+  auto load_mem_const(uint16_t address) -> void { // movzx eax, [r12 + disp32]
+    bytes({0x41, 0x0F, 0xB7, 0x84, 0x24});
+    imm32(address * 2u);
+  }
+
+  auto store_mem_const(uint16_t address) -> void { // mov [r12 + disp32], cx
+    bytes({0x66, 0x41, 0x89, 0x8C, 0x24});
+    imm32(address * 2u);
+  }
+
+  auto load_mem_eax() -> void { // movzx eax, word [r12 + rax*2]
+    bytes({0x41, 0x0F, 0xB7, 0x04, 0x44});
+  }
+
+  auto store_mem_eax() -> void { // mov word [r12 + rax*2], cx
+    bytes({0x66, 0x41, 0x89, 0x0C, 0x44});
+  }
+
+  auto add_eax_imm(uint16_t v) -> void {
+    byte(0x05);
+    imm32(v);
+  }
+
+  auto and_eax_imm(uint16_t v) -> void {
+    byte(0x25);
+    imm32(v);
+  }
+
+  auto add_eax_ecx() -> void { bytes({0x01, 0xC8}); }
+  auto and_eax_ecx() -> void { bytes({0x21, 0xC8}); }
+  auto not_eax() -> void { bytes({0xF7, 0xD0}); }
+  auto zero_extend_ax() -> void { bytes({0x0F, 0xB7, 0xC0}); }
+
+  auto cmp_eax_imm(uint32_t v) -> void {
+    byte(0x3D);
+    imm32(v);
+  }
+
+  auto cmp_code_map_eax() -> void { // cmp byte [r14 + rax], 0
+    bytes({0x41, 0x80, 0x3C, 0x06, 0x00});
+  }
+
+  auto cmp_code_map_const(uint16_t address) -> void { // cmp byte [r14 + disp32], 0
+    bytes({0x41, 0x80, 0xBE});
+    imm32(address);
+    byte(0x00);
+  }
+
+  auto test_ecx_imm(uint32_t v) -> void {
+    bytes({0xF7, 0xC1});
+    imm32(v);
+  }
+
+  // jcc rel32 with the displacement left for patch_rel32
+  auto jcc(uint8_t cc) -> uint8_t * {
+    bytes({0x0F, cc});
+    imm32(0);
+    return p - 4;
+  }
+
+  static auto patch_rel32(uint8_t *at, const uint8_t *target) -> void {
+    int32_t rel = static_cast<int32_t>(target - (at + 4));
+    std::memcpy(at, &rel, 4);
+  }
+
+  auto add_retired(int count) -> void { // add qword [r13], imm8
+    bytes({0x49, 0x83, 0x45, 0x00, static_cast<uint8_t>(count)});
+  }
+
+  // R_COND from the value of a guest register, without branches
+  auto materialize_cc(int guest) -> void {
+    load_reg(0, guest);
+    bytes({0x66, 0x85, 0xC0}); // test ax, ax
+    byte(0xB9);                // mov ecx, P
+    imm32(Flags::FL_POS);
+    byte(0xBA);                // mov edx, N
+    imm32(Flags::FL_NEG);
+    bytes({0x0F, 0x48, 0xCA}); // cmovs ecx, edx
+    byte(0xBA);                // mov edx, Z
+    imm32(Flags::FL_ZRO);
+    bytes({0x0F, 0x44, 0xCA}); // cmovz ecx, edx
+    store_reg(Registers::R_COND, 1);
+  }
+
+  auto return_eax() -> void { byte(0xC3); }
+
+  // a patchable block exit: `mov eax, value; ret`, later `jmp target`
+  auto exit_slot(uint32_t value) -> uint8_t * {
+    uint8_t *slot = p;
+    byte(0xB8);
+    imm32(value);
+    byte(0xC3);
+    return slot;
+  }
+
+  // `mov eax, value; ret` if the byte at `flag` is set
+  auto exit_if_set(const void *flag, uint32_t value) -> void {
+    byte(0xA0); // mov al, [moffs64]
+    uint64_t address = reinterpret_cast<uintptr_t>(flag);
+    std::memcpy(p, &address, 8);
+    p += 8;
+    bytes({0x84, 0xC0, 0x74, 0x06}); // test al, al; jz past the exit
+    byte(0xB8);
+    imm32(value);
+    byte(0xC3);
+  }
+
+  static auto patch_jump(uint8_t *slot, const uint8_t *target) -> void {
+    slot[0] = 0xE9;
+    patch_rel32(slot + 1, target);
+  }
+
+private:
+  uint8_t *p;
+};
+
+constexpr uint8_t JNE = 0x85;
+constexpr uint8_t JAE = 0x83;
+constexpr uint8_t JE = 0x84;
+
+class Translator {
+public:
+  explicit Translator(VM &vm) : vm(vm) {
+    void *mem = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    code = mem == MAP_FAILED ? nullptr : static_cast<uint8_t *>(mem);
+    if (code)
+      emit_entry();
+  }
+
+  ~Translator() {
+    if (code)
+      munmap(code, CODE_SIZE);
+  }
+
+  auto ok() const -> bool { return code != nullptr; }
+
+  auto flush() -> void {
+    top = blocks_start;
+    blocks.fill(nullptr);
+    code_map.fill(0);
+    pending.clear();
+  }
+
+  auto run() -> void {
+    vm.code_map = code_map.data();
+    auto &reg = vm.registers;
+    auto enter = reinterpret_cast<entry_fn>(code);
+    bool interpret = false;
+
+    while (vm.is_running) {
+      if (!interpret) {
+        const uint8_t *block = lookup(reg[Registers::R_PC]);
+        if (block) {
+          uint32_t next = enter(reg.data(), vm.memory.data(), &vm.retired,
+                                code_map.data(), block);
+          reg[Registers::R_PC] = static_cast<uint16_t>(next);
+          interpret = next & INTERPRET;
+          if (interrupt_requested.load(std::memory_order_relaxed)) [[unlikely]]
+            vm.is_running = false;
+          continue;
+        }
+      }
+
+      vm.step();
+      interpret = false;
+      if (vm.code_dirty) {
+        flush();
+        vm.code_dirty = false;
+      }
+    }
+    vm.code_map = nullptr;
+  }
+
+private:
+  // an out-of-line exit taken in the middle of a block
+  struct SideExit {
+    uint8_t *jump;  // rel32 to patch
+    uint16_t pc;    // instruction to interpret
+    int executed;   // instructions retired before it
+    int cc_reg;     // pending flag writer, -1 if none
+  };
+
+  auto lookup(uint16_t pc) -> const uint8_t * {
+    if (blocks[pc])
+      return blocks[pc];
+    if (top + CODE_SLACK > code + CODE_SIZE)
+      flush();
+    return translate(pc);
+  }
+
+  auto emit_entry() -> void {
+    Emitter e(code);
+    e.bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56}); // push rbx, r12-r14
+    e.bytes({0x48, 0x89, 0xFB});                         // mov rbx, rdi
+    e.bytes({0x49, 0x89, 0xF4});                         // mov r12, rsi
+    e.bytes({0x49, 0x89, 0xD5});                         // mov r13, rdx
+    e.bytes({0x49, 0x89, 0xCE});                         // mov r14, rcx
+    e.bytes({0x41, 0xFF, 0xD0});                         // call r8
+    e.bytes({0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B}); // pop r14-r12, rbx
+    e.return_eax();
+    blocks_start = top = e.here();
+  }
+
+  // exit to another block: direct jump if it is translated, else a slot
+  // that is patched once it is
+  auto exit_to(Emitter &e, uint16_t target) -> void {
+    uint8_t *slot = e.exit_slot(target);
+    if (blocks[target])
+      Emitter::patch_jump(slot, blocks[target]);
+    else
+      pending[target].push_back(slot);
+  }
+
+  static auto is_device(uint16_t address) -> bool { return address >= MappedReg::IO_PAGE; }
+
+  // instructions that never enter translated code
+  static auto translatable(uint16_t pc, uint16_t instruction) -> bool {
+    Decoded d = decode(pc, instruction);
+    switch (d.handler) {
+    case Handlers::TRAP:
+    case Handlers::OTHER:
+      return false;
+    case Handlers::LD:
+    case Handlers::LDI:
+    case Handlers::ST:
+    case Handlers::STI:
+      return !is_device(d.imm);
+    default:
+      return true;
+    }
+  }
+
+  auto translate(uint16_t start) -> const uint8_t * {
+    if (!translatable(start, vm.memory[start]))
+      return nullptr;
+
+    Emitter e(top);
+    uint8_t *entry = e.here();
+    // chained blocks never return on their own: SIGINT is checked at entry
+    e.exit_if_set(&interrupt_requested, start);
+    vector<SideExit> side_exits;
+    int cc_reg = -1; // guest register whose value R_COND is lazily derived from
+    int executed = 0;
+    uint16_t pc = start;
+
+    auto settle = [&](int count) {
+      if (cc_reg >= 0)
+        e.materialize_cc(cc_reg);
+      e.add_retired(count);
+    };
+    auto side_exit = [&](uint8_t cc) {
+      side_exits.push_back({e.jcc(cc), pc, executed, cc_reg});
+    };
+    // range check of a dynamic address in eax against the device page
+    auto check_device = [&] {
+      e.zero_extend_ax();
+      e.cmp_eax_imm(MappedReg::IO_PAGE);
+      side_exit(JAE);
+    };
+
+    bool ended = false;
+    while (!ended) {
+      uint16_t instruction = vm.memory[pc];
+      if (!translatable(pc, instruction)) {
+        settle(executed);
+        e.exit_slot(pc | INTERPRET);
+        break;
+      }
+      if (executed == MAX_BLOCK) {
+        settle(executed);
+        exit_to(e, pc);
+        break;
+      }
+
+      Decoded d = decode(pc, instruction);
+      code_map[pc] = 1;
+      uint16_t next = pc + 1;
+
+      switch (d.handler) {
+      case Handlers::ADD_REG:
+      case Handlers::AND_REG:
+        e.load_reg(0, d.r1);
+        e.load_reg(1, d.r2);
+        d.handler == Handlers::ADD_REG ? e.add_eax_ecx() : e.and_eax_ecx();
+        e.store_reg(d.r0, 0);
+        cc_reg = d.r0;
+        break;
+      case Handlers::ADD_IMM:
+      case Handlers::AND_IMM:
+        e.load_reg(0, d.r1);
+        d.handler == Handlers::ADD_IMM ? e.add_eax_imm(d.imm) : e.and_eax_imm(d.imm);
+        e.store_reg(d.r0, 0);
+        cc_reg = d.r0;
+        break;
+      case Handlers::NOT:
+        e.load_reg(0, d.r1);
+        e.not_eax();
+        e.store_reg(d.r0, 0);
+        cc_reg = d.r0;
+        break;
+      case Handlers::LEA:
+        e.store_reg_imm(d.r0, d.imm);
+        cc_reg = d.r0;
+        break;
+      case Handlers::LD:
+        e.load_mem_const(d.imm);
+        e.store_reg(d.r0, 0);
+        cc_reg = d.r0;
+        break;
+      case Handlers::LDR:
+      case Handlers::LDI:
+        if (d.handler == Handlers::LDR) {
+          e.load_reg(0, d.r1);
+          e.add_eax_imm(d.imm);
+        } else {
+          e.load_mem_const(d.imm);
+        }
+        check_device();
+        e.load_mem_eax();
+        e.store_reg(d.r0, 0);
+        cc_reg = d.r0;
+        break;
+      case Handlers::ST:
+        e.cmp_code_map_const(d.imm);
+        side_exit(JNE);
+        e.load_reg(1, d.r0);
+        e.store_mem_const(d.imm);
+        break;
+      case Handlers::STR:
+      case Handlers::STI:
+        if (d.handler == Handlers::STR) {
+          e.load_reg(0, d.r1);
+          e.add_eax_imm(d.imm);
+        } else {
+          e.load_mem_const(d.imm);
+        }
+        check_device();
+        e.cmp_code_map_eax();
+        side_exit(JNE);
+        e.load_reg(1, d.r0);
+        e.store_mem_eax();
+        break;
+      case Handlers::NOP:
+        break;
+      case Handlers::BR: {
+        if (cc_reg >= 0)
+          e.materialize_cc(cc_reg);
+        else
+          e.load_reg(1, Registers::R_COND);
+        cc_reg = -1;
+        e.add_retired(executed + 1);
+        e.test_ecx_imm(d.r0);
+        uint8_t *not_taken = e.jcc(JE);
+        exit_to(e, d.imm);
+        Emitter::patch_rel32(not_taken, e.here());
+        exit_to(e, next);
+        ended = true;
+      } break;
+      case Handlers::BR_ALWAYS:
+        settle(executed + 1);
+        exit_to(e, d.imm);
+        ended = true;
+        break;
+      case Handlers::JSR:
+        settle(executed + 1); // R_COND may still be derived from R7
+        e.store_reg_imm(Registers::R_R7, next);
+        exit_to(e, d.imm);
+        ended = true;
+        break;
+      case Handlers::JMP:
+      case Handlers::JSRR:
+        settle(executed + 1);
+        e.load_reg(0, d.r1); // target is read before JSRR overwrites R7
+        if (d.handler == Handlers::JSRR)
+          e.store_reg_imm(Registers::R_R7, next);
+        e.return_eax();
+        ended = true;
+        break;
+      }
+
+      ++executed;
+      pc = next;
+    }
+
+    for (auto &exit : side_exits) {
+      Emitter::patch_rel32(exit.jump, e.here());
+      cc_reg = exit.cc_reg;
+      settle(exit.executed);
+      e.exit_slot(exit.pc | INTERPRET);
+    }
+
+    top = e.here();
+    blocks[start] = entry;
+
+    // chain every exit that was waiting for this block
+    if (auto it = pending.find(start); it != pending.end()) {
+      for (auto *slot : it->second)
+        Emitter::patch_jump(slot, entry);
+      pending.erase(it);
+    }
+    return entry;
+  }
+
+  VM &vm;
+  uint8_t *code = nullptr;
+  uint8_t *blocks_start = nullptr;
+  uint8_t *top = nullptr;
+  array<const uint8_t *, VM::memory_size> blocks{};
+  array<uint8_t, VM::memory_size> code_map{};
+  unordered_map<uint16_t, vector<uint8_t *>> pending;
+};
+
+} // namespace
+
+auto run_jit(VM &vm) -> void {
+  auto translator = std::make_unique<Translator>(vm);
+  if (!translator->ok()) {
+    run_threaded(vm);
+    return;
+  }
+
+  vm.start();
+  translator->run();
+}
+
+#else
+
+auto jit_supported() -> bool { return false; }
+
+auto run_jit(VM &vm) -> void { run_threaded(vm); }
+
+#endif
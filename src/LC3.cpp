@@ -2,40 +2,196 @@
 
 #include "Specifics.h"
 #include "LC3.h"
+#include "Devices.h"
+#include "Input.h"
+#include "Metrics.h"
+#include "Profiler.h"
+#include "Snapshot.h"
+#include "Threaded.h"
+#include "Trace.h"
 
 #include <signal.h>
 #include <stdio.h>
 #include <cstdint>
 
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <vector>
 
 using std::array;
 using std::cout;
 using std::unique_ptr;
 
 
-constexpr uint32_t max = 1 << 16;
-array<uint16_t, max> memory; // 128KB memory store
+const char *const opcode_names[16] = {"BR",  "ADD", "LD",  "ST",  "JSR", "AND", "LDR", "STR",
+                                      "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
 
-// storing registers
-array<uint16_t, 10> registers;
+VM::VM(std::FILE *in, std::FILE *out) : counters(&Counters::local()) {
+  set_io(in, out);
+  attach_standard_devices(*this);
+}
 
-auto read_mem(uint16_t address) -> uint16_t {
-  if (address == MappedReg::MR_KBSR) {
-    if (check_key()) {
-      memory[MappedReg::MR_KBSR] = (1 << 15);
-      memory[MappedReg::MR_KBDR] = getchar();
-    } else {
-      memory[MappedReg::MR_KBSR] = 0;
+auto VM::attach(uint16_t address, Device *device) -> void {
+  if (address >= MappedReg::IO_PAGE)
+    devices[address - MappedReg::IO_PAGE] = device;
+}
+
+auto VM::set_io(std::FILE *in, std::FILE *out) -> void {
+  this->in = in;
+  this->out = out;
+  lookahead = EOF;
+  interactive = in && is_terminal(in);
+}
+
+auto VM::poll_key() -> uint16_t {
+  Counters::add(counters->kbsr_polls);
+  if (replayer) [[unlikely]]
+    return replayer->poll(*this);
+  bool was_running = is_running;
+  uint16_t ready = poll_input();
+  if (recorder) [[unlikely]] {
+    recorder->poll(ready);
+    if (was_running && !is_running)
+      recorder->stop();
+  }
+  return ready;
+}
+
+auto VM::get_char() -> uint16_t {
+  if (replayer) [[unlikely]]
+    return replayer->key(*this);
+  bool was_running = is_running;
+  uint16_t c = read_input();
+  // a read cut short by SIGINT ends the run as the end of input does
+  interrupted();
+  if (recorder) [[unlikely]] {
+    recorder->key(c);
+    if (was_running && !is_running)
+      recorder->stop();
+  }
+  return c;
+}
+
+auto VM::clock() -> uint16_t {
+  if (replayer) [[unlikely]]
+    return replayer->timer(*this);
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  auto ms = static_cast<uint16_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+  if (recorder) [[unlikely]]
+    recorder->timer(ms);
+  return ms;
+}
+
+// the terminal is polled with select(), scripted input is peeked instead so
+// that a guest spinning on KBSR sees every character of it in order
+auto VM::poll_input() -> uint16_t {
+  if (input) {
+    if (input->poll()) {
+      empty_polls = 0;
+      return 1;
     }
+    // an idle guest, so that its instructions show before it parks
+    publish_retired();
+    if (input->exhausted() && !interactive)
+      is_running = false;
+    else if (slicing && ++empty_polls >= InputQueue::spin_polls)
+      starved = true;
+    return 0;
   }
-  return memory[address];
+  if (interactive) {
+    publish_retired(); // cheap next to the syscall
+    Counters::add(counters->syscalls);
+    return check_key();
+  }
+
+  if (lookahead == EOF && in)
+    lookahead = read_char(in);
+  if (lookahead == EOF) {
+    // no more input will ever arrive; stop instead of spinning forever
+    is_running = false;
+    return 0;
+  }
+  return 1;
+}
+
+auto VM::read_input() -> uint16_t {
+  int c = lookahead;
+  lookahead = EOF;
+  if (c == EOF && !input && in && interactive) {
+    // waits for the user to type
+    auto begin = std::chrono::steady_clock::now();
+    c = read_char(in);
+    auto waited = std::chrono::steady_clock::now() - begin;
+    Counters::add(counters->syscalls);
+    Counters::add(counters->input_wait_ns,
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count());
+  } else if (c == EOF) {
+    c = input ? input->pop() : in ? read_char(in) : EOF;
+  }
+  if (c == EOF && !interactive)
+    is_running = false;
+  return static_cast<uint16_t>(c);
+}
+
+auto parse_flush(const char *name, Flush &flush) -> bool {
+  if (!std::strcmp(name, "always"))
+    flush = Flush::Always;
+  else if (!std::strcmp(name, "line"))
+    flush = Flush::Line;
+  else if (!std::strcmp(name, "full"))
+    flush = Flush::Full;
+  else
+    return false;
+  return true;
+}
+
+auto VM::set_output_buffering(Flush policy, size_t size) -> void {
+  flush_output();
+  flush_policy = policy;
+  flush_threshold = size ? size : 1;
+  pending.reserve(std::min<size_t>(flush_threshold, 1 << 20));
+}
+
+// one write per flush, however many characters the guest printed
+auto VM::flush_output() -> void {
+  if (out && !pending.empty()) {
+    fwrite(pending.data(), 1, pending.size(), out);
+    fflush(out);
+    Counters::add(counters->syscalls);
+  }
+  pending.clear();
+}
+
+auto VM::read_device(uint16_t address) -> uint16_t {
+  Device *device = devices[address - MappedReg::IO_PAGE];
+  uint16_t value = device ? device->read(*this, address) : memory[address];
+  interrupted();
+  return value;
 }
 
-auto write_mem(uint16_t address, uint16_t value) -> void {
+auto VM::write_mem(uint16_t address, uint16_t value) -> void {
   memory[address] = value;
+  if (decoded)
+    for (uint16_t i = 0; i < DECODE_WINDOW; ++i)
+      decoded[static_cast<uint16_t>(address - i)].handler = Handlers::DECODE;
+  if (code_map && code_map[address])
+    code_dirty = true;
+  if (address >= MappedReg::IO_PAGE) {
+    if (Device *device = devices[address - MappedReg::IO_PAGE])
+      device->write(*this, address, value);
+    interrupted();
+  }
 }
 
 auto extend_sign(uint16_t x, int bit_count) -> uint16_t {
@@ -45,7 +201,7 @@ auto extend_sign(uint16_t x, int bit_count) -> uint16_t {
   return x;
 }
 
-auto update_flags(uint16_t idx) -> void {
+auto VM::update_flags(uint16_t idx) -> void {
   if (registers[idx] == 0)
     registers[Registers::R_COND] = Flags::FL_ZRO;
   else if (registers[idx] >> 15)
@@ -56,227 +212,485 @@ auto update_flags(uint16_t idx) -> void {
 
 auto swap_16(uint16_t x) -> uint16_t { return (x << 8) | (x >> 8); }
 
-auto handle_interrupt(int signal) -> void {
+auto swap_words(uint16_t *dst, const uint8_t *src, size_t count) -> void {
+  size_t i = 0;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // a byte rotate of every lane: pshufb with SSSE3/AVX2, shifts with SSE2
+  using words = uint16_t __attribute__((vector_size(32)));
+  for (; i + sizeof(words) / 2 <= count; i += sizeof(words) / 2) {
+    words w;
+    std::memcpy(&w, src + 2 * i, sizeof w);
+    w = (w << 8) | (w >> 8);
+    std::memcpy(dst + i, &w, sizeof w);
+  }
+#endif
+  for (; i < count; ++i)
+    dst[i] = static_cast<uint16_t>(src[2 * i] << 8 | src[2 * i + 1]);
+}
+
+std::atomic<bool> interrupt_requested{false};
+static_assert(std::atomic<bool>::is_always_lock_free, "stored by a signal handler");
+static int interrupt_pipe[2] = {-1, -1};
+
+auto install_interrupt_handler() -> void {
+#if defined(_WIN32) || defined(_WIN64)
+  signal(SIGINT, handle_interrupt);
+#else
+  if (interrupt_pipe[0] < 0 && pipe(interrupt_pipe) == 0)
+    fcntl(interrupt_pipe[1], F_SETFL, O_NONBLOCK);
+  // no SA_RESTART: a GETC blocked on the terminal returns and sees the flag
+  struct sigaction action {};
+  action.sa_handler = handle_interrupt;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+#endif
+}
+
+auto handle_interrupt([[maybe_unused]] int signal) -> void {
+  if (interrupt_requested.exchange(true)) {
+    // the guest did not stop in time; tcsetattr is async-signal-safe
     restore_input_buffering();
-    cout << '\n';
-    exit(-2);
+    std::_Exit(-2);
+  }
+#if !defined(_WIN32) && !defined(_WIN64)
+  int saved = errno;
+  if (interrupt_pipe[1] >= 0) {
+    char c = 0;
+    [[maybe_unused]] auto n = write(interrupt_pipe[1], &c, 1);
+  }
+  errno = saved;
+#endif
 }
 
-static auto make_unique_file_ptr(const char *fname, const char *flags)
-    -> unique_ptr<std::FILE, decltype(&fclose)> {
-  return unique_ptr<std::FILE, decltype(&fclose)>(std::fopen(fname, flags), std::fclose);
+auto interrupt_fd() -> int { return interrupt_pipe[0]; }
+
+auto VM::load_image(const uint8_t *bytes, size_t size) -> bool {
+  if (size < 2 || size % 2)
+    return false;
+  uint16_t origin = bytes[0] << 8 | bytes[1];
+  size_t count = size / 2 - 1;
+  if (count > memory_size - origin)
+    return false;
+
+  swap_words(&memory[origin], bytes + 2, count);
+  return true;
 }
+
 // non-owning ptr
-auto read_image_file(std::FILE* file) -> void {
-  uint16_t origin;
-  fread(&origin, sizeof(uint16_t), 1, file);
-  origin = swap_16(origin);
+auto VM::read_image_file(std::FILE *file) -> bool {
+  std::vector<uint8_t> bytes;
+  uint8_t buffer[1 << 16];
+  for (size_t n; (n = fread(buffer, 1, sizeof buffer, file)) > 0;)
+    bytes.insert(bytes.end(), buffer, buffer + n);
+  return load_image(bytes.data(), bytes.size());
+}
+
+auto VM::read_image(const char *image_path) -> int {
+  FileView file(image_path);
+  if (!file.ok())
+    return 0;
+
+  if (is_snapshot(file.data(), file.size()))
+    return read_snapshot(*this, file.data(), file.size());
+  return load_image(file.data(), file.size());
+}
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LC3_VECTOR_STRINGS 1
 
-  uint16_t max_read = max - origin;
-  uint16_t* p = &memory[origin]; // check for soundness
-  size_t read = fread(p, sizeof(uint16_t), max_read, file);
+namespace {
+constexpr size_t chunk = 16; // words per vector
+using word_lanes = uint16_t __attribute__((vector_size(2 * chunk)));
+using char_lanes = uint8_t __attribute__((vector_size(chunk)));
 
-  while (read > 0) {
-    *p = swap_16(*p);
-    ++p;
+auto load(word_lanes &w, const uint16_t *words) -> void { std::memcpy(&w, words, sizeof w); }
 
-    read--;
+// some lane of a comparison result is set
+auto any(const word_lanes &mask) -> bool {
+  uint64_t q[sizeof mask / 8];
+  std::memcpy(q, &mask, sizeof mask);
+  uint64_t bits = 0;
+  for (uint64_t x : q)
+    bits |= x;
+  return bits != 0;
+}
+} // namespace
+#endif
+
+// words before the first zero one, at most `limit`
+static auto terminated_length(const uint16_t *words, size_t limit) -> size_t {
+  size_t n = 0;
+#if LC3_VECTOR_STRINGS
+  for (word_lanes w; n + chunk <= limit; n += chunk) {
+    load(w, words + n);
+    if (any(word_lanes(w == 0)))
+      break;
   }
+#endif
+  while (n < limit && words[n])
+    ++n;
+  return n;
 }
 
-auto read_image(const char *image_path) -> int {
-  auto file = make_unique_file_ptr(image_path, "rb");
-  if (!file.get())
-    return 0;
+// PUTS: one character per word, narrowed a vector at a time straight into
+// the output buffer
+auto VM::put_string(uint16_t address) -> void {
+  const uint16_t *words = &memory[address];
+  size_t n = terminated_length(words, memory_size - address);
+  size_t at = pending.size();
+  pending.resize(at + n);
+  char *out = pending.data() + at;
+
+  size_t i = 0;
+#if LC3_VECTOR_STRINGS
+  for (word_lanes w; i + chunk <= n; i += chunk) {
+    load(w, words + i);
+    char_lanes c = __builtin_convertvector(w, char_lanes);
+    std::memcpy(out + i, &c, sizeof c);
+  }
+#endif
+  for (; i < n; ++i)
+    out[i] = static_cast<char>(words[i]);
+  wrote(n);
+}
 
-  read_image_file(file.get());
-  return 1;
+// PUTSP: two characters per word, low byte first; a zero high byte is
+// skipped
+auto VM::put_packed_string(uint16_t address) -> void {
+  const uint16_t *words = &memory[address];
+  size_t n = terminated_length(words, memory_size - address);
+  size_t at = pending.size();
+  pending.resize(at + 2 * n);
+  char *out = pending.data() + at;
+
+  size_t i = 0, length = 0;
+#if LC3_VECTOR_STRINGS
+  // words with both bytes set already are the characters in output order
+  for (word_lanes w; i + chunk <= n; i += chunk) {
+    load(w, words + i);
+    if (any(word_lanes((w >> 8) == 0)))
+      break;
+    std::memcpy(out + length, &w, sizeof w);
+    length += sizeof w;
+  }
+#endif
+  for (; i < n; ++i) {
+    out[length++] = static_cast<char>(words[i] & 0xff);
+    if (words[i] >> 8)
+      out[length++] = static_cast<char>(words[i] >> 8);
+  }
+  pending.resize(at + length);
+  wrote(length);
 }
 
-inline auto trap_routines(uint16_t& instruction, bool &is_running) -> void {
+// under a guest OS its handler, if the interrupt vector table has one, is
+// entered as from user mode: PSR and PC are pushed on the R6 stack.
+// otherwise the guest stops.
+auto VM::exception(uint16_t vector, uint16_t instruction) -> void {
+  Counters::add(counters->exceptions);
+  uint16_t handler = memory[Vectors::INTERRUPT_TABLE + vector];
+  if (traps == Traps::Guest && handler) {
+    uint16_t psr = (1 << 15) | registers[Registers::R_COND];
+    write_mem(--registers[Registers::R_R6], psr);
+    write_mem(--registers[Registers::R_R6], registers[Registers::R_PC]);
+    registers[Registers::R_PC] = handler;
+    return;
+  }
+  flush_output();
+  std::fprintf(stderr, "%s x%04x at x%04x\n",
+               vector == Vectors::PRIVILEGE_MODE ? "privilege mode violation:" : "illegal opcode",
+               instruction, static_cast<uint16_t>(registers[Registers::R_PC] - 1));
+  is_running = false;
+}
+
+auto VM::trap_routines(uint16_t instruction) -> void {
+  uint16_t vector = instruction & 0xff;
+  if (instruction >> 12 == Opcodes::OP_TRAP && traps == Traps::Native && slicing && input &&
+      (vector == TrapCodes::TRAP_GETC || vector == TrapCodes::TRAP_IN) && !input->ready() &&
+      !input->exhausted()) {
+    // yield instead of blocking; the TRAP runs again once a key is there,
+    // and is counted then
+    registers[Registers::R_PC]--;
+    retired--;
+    if (Counters::by_opcode)
+      --unpublished[Opcodes::OP_TRAP];
+    starved = true;
+    return;
+  }
+
+  publish_retired();
+  switch (instruction >> 12) {
+  case Opcodes::OP_TRAP:
+    break;
+  case Opcodes::OP_RTI:
+    if (traps == Traps::Guest) {
+      registers[Registers::R_PC] = read_mem(registers[Registers::R_R6]++);
+      registers[Registers::R_COND] = read_mem(registers[Registers::R_R6]++) & 0x7;
+    } else {
+      exception(Vectors::PRIVILEGE_MODE, instruction);
+    }
+    return;
+  default:
+    exception(Vectors::ILLEGAL_OPCODE, instruction);
+    return;
+  }
+
+  Counters::add(counters->traps[vector]);
+  if (traps == Traps::Guest) {
+    registers[Registers::R_R7] = registers[Registers::R_PC];
+    registers[Registers::R_PC] = memory[Vectors::TRAP_TABLE + vector];
+    return;
+  }
 
   registers[Registers::R_R7] = registers[Registers::R_PC];
 
-  switch (instruction & 0xff) {
+  switch (vector) {
   case TrapCodes::TRAP_GETC: {
-    registers[Registers::R_R0] = static_cast<uint16_t>(getchar());
+    registers[Registers::R_R0] = get_char();
     update_flags(Registers::R_R0);
   } break;
 
   case TrapCodes::TRAP_OUT: {
-    putc(static_cast<char>(registers[Registers::R_R0]), stdout);
-    fflush(stdout);
+    put(static_cast<char>(registers[Registers::R_R0]));
+    end_output();
   } break;
 
   case TrapCodes::TRAP_PUTS: {
-    // should you use non-owning pointers? 
-    uint16_t* ptr = &memory[registers[Registers::R_R0]];
-
-    while (*ptr) {
-      putc(static_cast<char>(*ptr), stdout);
-      ++ptr;
-    }
-
-    fflush(stdout);
+    put_string(registers[Registers::R_R0]);
+    end_output();
   } break;
 
   case TrapCodes::TRAP_IN: {
-    cout << "Enter a caracter: ";
+    static constexpr char prompt[] = "Enter a caracter: ";
+    put(prompt, sizeof prompt - 1);
+    end_output();
 
-    char c = getchar();
-    putc(c, stdout);
-    fflush(stdout);
+    char c = static_cast<char>(get_char());
+    put(c);
+    end_output();
 
     registers[Registers::R_R0] = static_cast<uint16_t>(c);
     update_flags(Registers::R_R0);
   } break;
 
   case TrapCodes::TRAP_PUTSP: {
-    uint16_t* ptr = &memory[registers[Registers::R_R0]];
-
-    while (*ptr) {
-      char c1 = (*ptr) & 0xff;
-      putc(c1, stdout);
-      char c2 = (*ptr) >> 8;
-      if (c2) {
-        putc(c2, stdout);
-      }
-      ++ptr;
-    }
-    fflush(stdout);
+    put_packed_string(registers[Registers::R_R0]);
+    end_output();
   } break;
 
   case TrapCodes::TRAP_HALT: {
-    puts("HALT");
-    fflush(stdout);
+    put("HALT\n", 5);
+    flush_output();
     is_running = false;
   } break;
+
+  default:
+    // a routine the guest installed itself
+    if (uint16_t routine = memory[Vectors::TRAP_TABLE + vector])
+      registers[Registers::R_PC] = routine;
+    break;
   }
 }
 
-auto run_vm() -> void {
-  
-  registers[Registers::R_COND] = Flags::FL_ZRO;
-  constexpr uint16_t PC_START = 0x3000;
-  registers[Registers::R_PC] = PC_START;
-
-  bool is_running = true;
-  while (is_running) {
-
-    auto instruction = read_mem(registers[Registers::R_PC]++);
-    auto op = instruction >> 12;
+// executes the instruction at PC
+auto VM::step() -> void {
+  auto instruction = read_mem(registers[Registers::R_PC]++);
+  auto op = instruction >> 12;
+  ++retired;
+
+  switch (op) {
+  case Opcodes::OP_ADD: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t r1 = (instruction >> 6) & 0x7;
+    uint16_t imm_flag = (instruction >> 5) & 0x1;
+
+    if (imm_flag) {
+      auto imm = extend_sign(instruction & 0x1F, 5);
+      registers[r0] = registers[r1] + imm;
+    } else {
+      uint16_t r2 = (instruction & 0x7);
+      registers[r0] = registers[r1] + registers[r2];
+    }
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_AND: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t r1 = (instruction >> 6) & 0x7;
+    uint16_t imm_flag = (instruction >> 5) & 0x1;
+
+    if (imm_flag) {
+      uint16_t imm5 = extend_sign(instruction & 0x1F, 5);
+      registers[r0] = registers[r1] & imm5;
+    } else {
+      uint16_t r2 = instruction & 0x7;
+      registers[r0] = registers[r1] & registers[r2];
+    }
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_NOT: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t r1 = (instruction >> 6) & 0x7;
 
-    switch (op) {
-    case Opcodes::OP_ADD: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t r1 = (instruction >> 6) & 0x7;
-      uint16_t imm_flag = (instruction >> 5) & 0x1;
-
-      if (imm_flag) {
-        auto imm = extend_sign(instruction & 0x1F, 5);
-        registers[r0] = registers[r1] + imm;
-      } else {
-        uint16_t r2 = (instruction & 0x7);
-        registers[r0] = registers[r1] + registers[r2];
-      }
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_AND: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t r1 = (instruction >> 6) & 0x7;
-      uint16_t imm_flag = (instruction >> 5) & 0x1;
-
-      if (imm_flag) {
-        uint16_t imm5 = extend_sign(instruction & 0x1F, 5);
-        registers[r0] = registers[r1] & imm5;
-      } else {
-        uint16_t r2 = instruction & 0x7;
-        registers[r0] = registers[r1] & registers[r2];
-      }
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_NOT: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t r1 = (instruction >> 6) & 0x7;
+    registers[r0] = ~registers[r1];
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_BR: {
+    uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
+    uint16_t cond_flag = (instruction >> 9) & 0x7;
+    // every loop passes a taken branch or a jump, where SIGINT is checked
+    if (cond_flag & registers[Registers::R_COND]) {
+      registers[Registers::R_PC] += pc_offset;
+      interrupted();
+    }
+  } break;
+  case Opcodes::OP_JMP: {
+    uint16_t r1 = (instruction >> 6) & 0x7;
+    registers[Registers::R_PC] = registers[r1];
+    interrupted();
+  } break;
+  case Opcodes::OP_JSR: {
+    uint16_t long_flag = (instruction >> 11) & 1;
+    registers[Registers::R_R7] = registers[Registers::R_PC];
 
-      registers[r0] = ~registers[r1];
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_BR: {
-      uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
-      uint16_t cond_flag = (instruction >> 9) & 0x7;
-      if (cond_flag & registers[Registers::R_COND])
-        registers[Registers::R_PC] += pc_offset;
-    } break;
-    case Opcodes::OP_JMP: {
+    if (long_flag) {
+      uint16_t long_pc_offset = extend_sign(instruction & 0x7FF, 11);
+      registers[Registers::R_PC] += long_pc_offset;
+    } else {
       uint16_t r1 = (instruction >> 6) & 0x7;
       registers[Registers::R_PC] = registers[r1];
-    } break;
-    case Opcodes::OP_JSR: {
-      uint16_t long_flag = (instruction >> 11) & 1;
-      registers[Registers::R_R7] = registers[Registers::R_PC];
-
-      if (long_flag) {
-        uint16_t long_pc_offset = extend_sign(instruction & 0x7FF, 11);
-        registers[Registers::R_PC] += long_pc_offset;
-      } else {
-        uint16_t r1 = (instruction >> 6) & 0x7;
-        registers[Registers::R_PC] = registers[r1];
-      }
-    } break;
-    case Opcodes::OP_LD: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
-
-      registers[r0] = read_mem(registers[Registers::R_PC] + pc_offset);
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_LDI: {
-      uint16_t r0 = (instruction >> 9) & 0x07;
-      uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
-
-      registers[r0] = read_mem(read_mem(registers[Registers::R_PC] + pc_offset));
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_LDR: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t r1 = (instruction >> 6) & 0x7;
-      uint16_t offset = extend_sign(instruction & 0x3f, 6);
-
-      registers[r0] = read_mem(registers[r1] + offset);
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_LEA: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
-
-      registers[r0] = registers[Registers::R_PC] + pc_offset;
-      update_flags(r0);
-    } break;
-    case Opcodes::OP_ST: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
-
-      write_mem(registers[Registers::R_PC] + pc_offset, registers[r0]); // redundant?
-    } break;
-    case Opcodes::OP_STI: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
-
-      write_mem(read_mem(registers[Registers::R_PC] + pc_offset), registers[r0]);
-    } break;
-    case Opcodes::OP_STR: {
-      uint16_t r0 = (instruction >> 9) & 0x7;
-      uint16_t r1 = (instruction >> 6) & 0x7;
-      uint16_t offset = extend_sign(instruction & 0x3F, 6);
+    }
+    interrupted();
+  } break;
+  case Opcodes::OP_LD: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
 
-      write_mem(registers[r1] + offset, registers[r0]);
-    } break;
-    default:{
-      trap_routines(instruction, is_running);
-      break;
+    registers[r0] = read_mem(registers[Registers::R_PC] + pc_offset);
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_LDI: {
+    uint16_t r0 = (instruction >> 9) & 0x07;
+    uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
+
+    registers[r0] = read_mem(read_mem(registers[Registers::R_PC] + pc_offset));
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_LDR: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t r1 = (instruction >> 6) & 0x7;
+    uint16_t offset = extend_sign(instruction & 0x3f, 6);
+
+    registers[r0] = read_mem(registers[r1] + offset);
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_LEA: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
+
+    registers[r0] = registers[Registers::R_PC] + pc_offset;
+    update_flags(r0);
+  } break;
+  case Opcodes::OP_ST: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
+
+    write_mem(registers[Registers::R_PC] + pc_offset, registers[r0]); // redundant?
+  } break;
+  case Opcodes::OP_STI: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t pc_offset = extend_sign(instruction & 0x1FF, 9);
+
+    write_mem(read_mem(registers[Registers::R_PC] + pc_offset), registers[r0]);
+  } break;
+  case Opcodes::OP_STR: {
+    uint16_t r0 = (instruction >> 9) & 0x7;
+    uint16_t r1 = (instruction >> 6) & 0x7;
+    uint16_t offset = extend_sign(instruction & 0x3F, 6);
+
+    write_mem(registers[r1] + offset, registers[r0]);
+  } break;
+  default:{
+    trap_routines(instruction);
+    break;
+  }
+  }
+}
+
+auto VM::start() -> void {
+  if (!resume) {
+    registers[Registers::R_COND] = Flags::FL_ZRO;
+    registers[Registers::R_PC] = PC_START;
+  }
+  resume = false;
+  is_running = true;
+  counters = &Counters::local();
+}
+
+auto VM::publish() -> void {
+  publish_retired();
+  for (size_t op = 0; op < unpublished.size(); ++op) {
+    if (unpublished[op]) {
+      Counters::add(counters->opcodes[op], unpublished[op]);
+      unpublished[op] = 0;
     }
+  }
+}
+
+auto VM::publish_retired() -> void {
+  Counters::add(counters->instructions, retired - published);
+  published = retired;
+}
+
+auto VM::run_vm() -> void {
+  start();
+  if (profiler) {
+    // a loop of its own, so that unprofiled runs pay nothing for profiling
+    while (is_running) {
+      uint16_t pc = registers[Registers::R_PC];
+      uint16_t instruction = memory[pc];
+      step();
+      profiler->record(*this, pc, instruction);
+    }
+    return;
+  }
+  // counted in chunks, so that watchers see a guest that never traps make
+  // progress; opcodes in a loop of their own, only for a metrics socket
+  if (Counters::by_opcode) {
+    while (is_running) {
+      for (int i = 0; i < 1 << 16 && is_running; ++i) {
+        ++unpublished[memory[registers[Registers::R_PC]] >> 12];
+        step();
+      }
+      publish();
     }
-    // is_running = false;
+    return;
   }
+  while (is_running) {
+    for (int i = 0; i < 1 << 16 && is_running; ++i)
+      step();
+    publish_retired();
+  }
+}
+
+auto VM::run_for(uint64_t budget) -> RunStatus {
+  counters = &Counters::local(); // guests move between threads
+  slicing = true;
+  starved = false;
+  uint64_t end = retired + budget;
+  if (Counters::by_opcode) {
+    while (is_running && !starved && retired < end) {
+      ++unpublished[memory[registers[Registers::R_PC]] >> 12];
+      step();
+    }
+  } else {
+    while (is_running && !starved && retired < end)
+      step();
+  }
+  slicing = false;
+  publish();
+
+  if (!is_running)
+    return RunStatus::Halted;
+  return starved ? RunStatus::Input : RunStatus::Budget;
 }
+
@@ -0,0 +1,389 @@
+#include "Lockstep.h"
+#include "LC3.h"
+#include "Threaded.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+using std::unique_ptr;
+using std::vector;
+
+// a guest left by the lockstep engine continues from its current PC
+static auto run_scalar(VM &vm) -> void {
+  vm.code_map = nullptr;
+  vm.code_dirty = false;
+  while (vm.is_running)
+    vm.step();
+}
+
+#if defined(__GNUC__)
+
+namespace {
+
+constexpr size_t L = LOCKSTEP_LANES;
+static_assert(L <= 32, "lanes are tracked in a 32-bit mask");
+
+using bits = uint32_t; // one bit per lane
+
+// GCC vector extensions; each operation compiles to SSE2 or AVX2 as the
+// target allows
+using lanes = uint16_t __attribute__((vector_size(2 * L)));
+
+template <typename F> auto each(bits set, F f) -> void {
+  for (; set; set &= set - 1)
+    f(__builtin_ctz(set));
+}
+
+// lanes waiting to run from `pc`
+struct Group {
+  uint16_t pc;
+  bits lanes;
+};
+
+class Lockstep {
+public:
+  Lockstep(VM *const *vms, size_t count);
+
+  auto run() -> void;
+
+private:
+  auto load_lane(int i) -> void;
+  auto store_lane(int i, uint16_t lane_pc) -> void;
+  auto activate(bits lanes) -> void;
+  auto settle() -> void;
+  auto drop(bits lanes, uint16_t lane_pc) -> void;
+  auto schedule() -> bool;
+  auto fetch() -> const Decoded *;
+  auto read(int i, uint16_t address) -> uint16_t;
+  auto set_cc(int r) -> void;
+  auto blend(int r, const lanes &value) -> void { reg[r] = (value & active) | (reg[r] & ~active); }
+
+  VM *vm[L] = {};
+  lanes reg[8] = {}; // R0-R7 of every lane
+  lanes cond = {};
+  lanes active = {}; // all ones in the lanes of the running group
+
+  bits group = 0; // lanes of the running group, all at pc
+  uint16_t pc = VM::PC_START;
+  uint64_t steps = 0; // instructions run by the group since the last settle
+  vector<Group> waiting;
+
+  // addresses run in lockstep; doubles as the VMs' code_map, so a store to
+  // one of them sets that guest's code_dirty
+  unique_ptr<uint8_t[]> executed;
+  unique_ptr<Decoded[]> decoded;
+};
+
+Lockstep::Lockstep(VM *const *vms, size_t count)
+    : executed(new uint8_t[VM::memory_size]()), decoded(new Decoded[VM::memory_size]) {
+  for (size_t i = 0; i < count; ++i) {
+    vm[i] = vms[i];
+    vm[i]->start();
+    pc = vm[0]->registers[Registers::R_PC];
+    // only guests starting from the same image or snapshot can share
+    // instructions
+    if (vm[i]->memory != vm[0]->memory || vm[i]->registers[Registers::R_PC] != pc)
+      continue;
+    vm[i]->code_map = executed.get();
+    load_lane(static_cast<int>(i));
+    group |= bits(1) << i;
+  }
+  activate(group);
+}
+
+auto Lockstep::load_lane(int i) -> void {
+  for (int r = 0; r < 8; ++r)
+    reg[r][i] = vm[i]->registers[r];
+  cond[i] = vm[i]->registers[Registers::R_COND];
+}
+
+auto Lockstep::store_lane(int i, uint16_t lane_pc) -> void {
+  for (int r = 0; r < 8; ++r)
+    vm[i]->registers[r] = reg[r][i];
+  vm[i]->registers[Registers::R_PC] = lane_pc;
+  vm[i]->registers[Registers::R_COND] = cond[i];
+}
+
+auto Lockstep::activate(bits lanes) -> void {
+  for (size_t i = 0; i < L; ++i)
+    active[i] = lanes >> i & 1 ? 0xffff : 0;
+}
+
+// instructions are counted per group and credited to its lanes whenever the
+// group changes
+auto Lockstep::settle() -> void {
+  each(group, [this](int i) { vm[i]->retired += steps; });
+  steps = 0;
+}
+
+// takes lanes out of lockstep; their state goes back to their VMs
+auto Lockstep::drop(bits lanes, uint16_t lane_pc) -> void {
+  settle();
+  each(lanes, [&](int i) { store_lane(i, lane_pc); });
+  group &= ~lanes;
+  activate(group);
+}
+
+// parks the running group and resumes the one with the lowest PC, together
+// with every other group at that PC: lanes that took different paths meet
+// again at the first common address
+auto Lockstep::schedule() -> bool {
+  settle();
+  if (group)
+    waiting.push_back({pc, group});
+  group = 0;
+  if (waiting.empty())
+    return false;
+
+  pc = std::min_element(waiting.begin(), waiting.end(), [](const Group &a, const Group &b) {
+         return a.pc < b.pc;
+       })->pc;
+  for (const auto &w : waiting)
+    if (w.pc == pc)
+      group |= w.lanes;
+  waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                               [this](const Group &w) { return w.pc == pc; }),
+                waiting.end());
+  activate(group);
+  return true;
+}
+
+// the decoded instruction at pc. the first time an address runs, every guest
+// still in lockstep must hold the same word there; the others leave
+auto Lockstep::fetch() -> const Decoded * {
+  if (executed[pc])
+    return &decoded[pc];
+
+  if (pc >= MappedReg::IO_PAGE) {
+    drop(group, pc);
+    return nullptr;
+  }
+  uint16_t word = vm[__builtin_ctz(group)]->memory[pc];
+  auto differs = [&](int i) { return vm[i]->memory[pc] != word; };
+
+  bits leaving = 0;
+  each(group, [&](int i) { leaving |= bits(differs(i)) << i; });
+  if (leaving)
+    drop(leaving, pc);
+  for (auto &w : waiting) {
+    each(w.lanes, [&](int i) {
+      if (differs(i)) {
+        store_lane(i, w.pc);
+        w.lanes &= ~(bits(1) << i);
+      }
+    });
+  }
+  waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                               [](const Group &w) { return !w.lanes; }),
+                waiting.end());
+  if (!group)
+    return nullptr;
+
+  executed[pc] = 1;
+  decoded[pc] = decode(pc, word);
+  return &decoded[pc];
+}
+
+auto Lockstep::read(int i, uint16_t address) -> uint16_t {
+  return address < MappedReg::IO_PAGE ? vm[i]->memory[address] : vm[i]->read_mem(address);
+}
+
+auto Lockstep::set_cc(int r) -> void {
+  // comparisons give 0 or -1 per lane, which converts to 0 or 0xffff
+  lanes zero = __builtin_convertvector(reg[r] == 0, lanes);
+  lanes negative = __builtin_convertvector(reg[r] >= 0x8000, lanes);
+  lanes flags = (zero & Flags::FL_ZRO) | (negative & Flags::FL_NEG) |
+                (~(zero | negative) & Flags::FL_POS);
+  cond = (flags & active) | (cond & ~active);
+}
+
+auto Lockstep::run() -> void {
+  while (schedule()) {
+    for (;;) {
+      const Decoded *d = fetch();
+      if (!d)
+        break;
+      ++steps;
+
+      uint16_t next = pc + 1;
+      bool jumped = false;
+      bits leaving = 0;
+      lanes value;
+
+      switch (d->handler) {
+      case Handlers::ADD_REG:
+        blend(d->r0, reg[d->r1] + reg[d->r2]);
+        set_cc(d->r0);
+        break;
+      case Handlers::ADD_IMM:
+        blend(d->r0, reg[d->r1] + d->imm);
+        set_cc(d->r0);
+        break;
+      case Handlers::AND_REG:
+        blend(d->r0, reg[d->r1] & reg[d->r2]);
+        set_cc(d->r0);
+        break;
+      case Handlers::AND_IMM:
+        blend(d->r0, reg[d->r1] & d->imm);
+        set_cc(d->r0);
+        break;
+      case Handlers::NOT:
+        blend(d->r0, ~reg[d->r1]);
+        set_cc(d->r0);
+        break;
+      case Handlers::LEA:
+        value = lanes{} + d->imm;
+        blend(d->r0, value);
+        set_cc(d->r0);
+        break;
+
+      case Handlers::LD:
+      case Handlers::LDI:
+      case Handlers::LDR: {
+        // a gather: every lane reads its own memory
+        bool device = false;
+        each(group, [&](int i) {
+          uint16_t address = d->handler == Handlers::LDR ? reg[d->r1][i] + d->imm : d->imm;
+          if (d->handler == Handlers::LDI) {
+            device |= address >= MappedReg::IO_PAGE;
+            address = read(i, address);
+          }
+          device |= address >= MappedReg::IO_PAGE;
+          reg[d->r0][i] = read(i, address);
+        });
+        set_cc(d->r0);
+        // a keyboard read stops a guest whose input has ended
+        if (device)
+          each(group, [&](int i) { leaving |= bits(!vm[i]->is_running) << i; });
+      } break;
+
+      case Handlers::ST:
+      case Handlers::STI:
+      case Handlers::STR:
+        each(group, [&](int i) {
+          uint16_t address = d->handler == Handlers::STR   ? reg[d->r1][i] + d->imm
+                             : d->handler == Handlers::STI ? read(i, d->imm)
+                                                           : d->imm;
+          vm[i]->write_mem(address, reg[d->r0][i]);
+          // self-modifying guests and guests stopped through MCR leave
+          if (vm[i]->code_dirty || !vm[i]->is_running)
+            leaving |= bits(1) << i;
+        });
+        break;
+
+      case Handlers::BR: {
+        lanes hit = cond & d->r0;
+        bits taken = 0;
+        each(group, [&](int i) { taken |= bits(hit[i] != 0) << i; });
+        if (taken == group) {
+          next = d->imm;
+        } else if (taken) {
+          settle();
+          waiting.push_back({next, group & ~taken});
+          group = taken;
+          activate(group);
+          next = d->imm;
+        }
+        jumped = true;
+      } break;
+      case Handlers::BR_ALWAYS:
+        next = d->imm;
+        jumped = true;
+        break;
+      case Handlers::NOP:
+        break;
+      case Handlers::JSR:
+        value = lanes{} + next;
+        blend(Registers::R_R7, value);
+        next = d->imm;
+        jumped = true;
+        break;
+      case Handlers::JMP:
+      case Handlers::JSRR: {
+        lanes target = reg[d->r1];
+        if (d->handler == Handlers::JSRR) {
+          value = lanes{} + next;
+          blend(Registers::R_R7, value);
+        }
+        // lanes jumping elsewhere than the first one wait at their target
+        next = target[__builtin_ctz(group)];
+        bits rest = 0;
+        each(group, [&](int i) { rest |= bits(target[i] != next) << i; });
+        if (rest) {
+          settle();
+          group &= ~rest;
+          activate(group);
+          while (rest) {
+            uint16_t other = target[__builtin_ctz(rest)];
+            bits same = 0;
+            each(rest, [&](int i) { same |= bits(target[i] == other) << i; });
+            waiting.push_back({other, same});
+            rest &= ~same;
+          }
+        }
+        jumped = true;
+      } break;
+
+      default: { // TRAP, RTI, RES: the VM's own routines, lane by lane
+        bits redirected = 0;
+        each(group, [&](int i) {
+          store_lane(i, next);
+          vm[i]->trap_routines(d->raw);
+          load_lane(i);
+          if (!vm[i]->is_running)
+            leaving |= bits(1) << i;
+          else if (vm[i]->registers[Registers::R_PC] != next)
+            redirected |= bits(1) << i;
+        });
+        // lanes continuing in a guest routine leave; their VMs are current
+        if (redirected) {
+          settle();
+          group &= ~redirected;
+          activate(group);
+        }
+      } break;
+      }
+
+      // SIGINT stops every lane at its next jump, as in the scalar engines
+      if (jumped && interrupt_requested.load(std::memory_order_relaxed)) [[unlikely]] {
+        each(group, [&](int i) { vm[i]->is_running = false; });
+        leaving = group;
+      }
+
+      pc = next;
+      if (leaving)
+        drop(leaving, next);
+      if (!group || (jumped && !waiting.empty()))
+        break;
+    }
+  }
+
+  for (VM *guest : vm) {
+    if (guest) {
+      run_scalar(*guest);
+      guest->flush_output();
+      guest->publish();
+    }
+  }
+}
+
+} // namespace
+
+auto run_lockstep(VM *const *vms, size_t count) -> void {
+  for (size_t first = 0; first < count; first += L)
+    Lockstep(vms + first, std::min(L, count - first)).run();
+}
+
+#else
+
+auto run_lockstep(VM *const *vms, size_t count) -> void {
+  for (size_t i = 0; i < count; ++i) {
+    vms[i]->run_vm();
+    vms[i]->flush_output();
+    vms[i]->publish();
+  }
+}
+
+#endif
@@ -0,0 +1,232 @@
+#include "Metrics.h"
+#include "LC3.h"
+
+#include <cstdio>
+#include <ostream>
+#include <sstream>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+std::atomic<Counters *> Counters::head{nullptr};
+bool Counters::by_opcode = false;
+
+auto Counters::local() -> Counters & {
+  thread_local Counters *mine = nullptr;
+  if (!mine) [[unlikely]] {
+    mine = new Counters;
+    mine->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(mine->next, mine, std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+  return *mine;
+}
+
+auto collect_metrics() -> MetricsSnapshot {
+  auto value = [](const Counters::Counter &c) { return c.load(std::memory_order_relaxed); };
+  MetricsSnapshot m;
+  for (const Counters *c = Counters::first(); c; c = c->following()) {
+    m.instructions += value(c->instructions);
+    for (size_t i = 0; i < m.opcodes.size(); ++i)
+      m.opcodes[i] += value(c->opcodes[i]);
+    for (size_t i = 0; i < m.traps.size(); ++i)
+      m.traps[i] += value(c->traps[i]);
+    m.exceptions += value(c->exceptions);
+    m.kbsr_polls += value(c->kbsr_polls);
+    m.syscalls += value(c->syscalls);
+    m.input_wait_ns += value(c->input_wait_ns);
+    ++m.threads;
+  }
+  return m;
+}
+
+auto write_metrics(const MetricsSnapshot &m, std::ostream &out) -> void {
+  auto family = [&out](const char *name, const char *type, const char *help) {
+    out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+  };
+  auto single = [&](const char *name, const char *type, const char *help, auto value) {
+    family(name, type, help);
+    out << name << ' ' << value << '\n';
+  };
+
+  single("lc3_instructions_total", "counter", "Instructions retired by all guests.",
+         m.instructions);
+
+  if (Counters::by_opcode) {
+    family("lc3_opcode_instructions_total", "counter",
+           "Instructions run by the switch engine, by opcode.");
+    for (size_t op = 0; op < m.opcodes.size(); ++op)
+      out << "lc3_opcode_instructions_total{opcode=\"" << opcode_names[op] << "\"} "
+          << m.opcodes[op] << '\n';
+  }
+
+  // the standard vectors always, others once used
+  family("lc3_traps_total", "counter", "TRAP instructions, by vector.");
+  for (size_t vector = 0; vector < m.traps.size(); ++vector) {
+    bool standard = vector >= TrapCodes::TRAP_GETC && vector <= TrapCodes::TRAP_HALT;
+    if (!standard && !m.traps[vector])
+      continue;
+    char label[8];
+    std::snprintf(label, sizeof label, "x%02X", static_cast<unsigned>(vector));
+    out << "lc3_traps_total{vector=\"" << label << "\"} " << m.traps[vector] << '\n';
+  }
+
+  single("lc3_exceptions_total", "counter",
+         "Illegal opcodes and privilege mode violations raised by guests.", m.exceptions);
+  single("lc3_kbsr_polls_total", "counter", "Reads of the keyboard status register.",
+         m.kbsr_polls);
+  single("lc3_syscalls_total", "counter", "Host system calls issued for guest I/O.",
+         m.syscalls);
+  single("lc3_input_wait_seconds_total", "counter",
+         "Time guests spent blocked or parked waiting for a key.", m.input_wait_ns / 1e9);
+  single("lc3_metric_threads", "gauge", "Threads that have counted guest activity.",
+         m.threads);
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+MetricsServer::MetricsServer(const char *) {}
+MetricsServer::~MetricsServer() = default;
+auto MetricsServer::serve() -> void {}
+auto MetricsServer::answer(int) -> void {}
+
+#else
+
+// where the SIGUSR1 handler asks the server thread for a dump
+static std::atomic<int> signal_pipe{-1};
+static_assert(std::atomic<int>::is_always_lock_free, "used from a signal handler");
+
+extern "C" void request_dump(int) {
+  int saved = errno;
+  int fd = signal_pipe.load(std::memory_order_relaxed);
+  if (fd >= 0) {
+    char c = 'd';
+    [[maybe_unused]] auto n = write(fd, &c, 1);
+  }
+  errno = saved;
+}
+
+static auto send_all(int fd, const std::string &text) -> void {
+  for (size_t sent = 0; sent < text.size();) {
+    ssize_t n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    sent += static_cast<size_t>(n);
+  }
+}
+
+MetricsServer::MetricsServer(const char *socket_path) {
+  if (pipe(wake_pipe) != 0) {
+    wake_pipe[0] = wake_pipe[1] = -1;
+    return;
+  }
+  // a burst of signals must never block the handler
+  fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+  if (socket_path) {
+    path = socket_path;
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() < sizeof address.sun_path) {
+      path.copy(address.sun_path, path.size());
+      // a socket left behind by an earlier run, but never another file
+      struct stat st {};
+      if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+      listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listener >= 0 &&
+          (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof address) != 0 ||
+           listen(listener, 16) != 0)) {
+        close(listener);
+        listener = -1;
+      }
+    }
+  }
+
+  signal_pipe = wake_pipe[1];
+  struct sigaction action {};
+  action.sa_handler = request_dump;
+  action.sa_flags = SA_RESTART; // guest input reads carry on undisturbed
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, nullptr);
+
+  thread = std::thread([this] { serve(); });
+}
+
+MetricsServer::~MetricsServer() {
+  if (wake_pipe[0] < 0)
+    return;
+  signal(SIGUSR1, SIG_IGN);
+  signal_pipe = -1;
+  char c = 'q';
+  [[maybe_unused]] auto n = write(wake_pipe[1], &c, 1);
+  thread.join();
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  if (listener >= 0) {
+    close(listener);
+    unlink(path.c_str());
+  }
+}
+
+auto MetricsServer::serve() -> void {
+  for (;;) {
+    pollfd fds[2] = {{wake_pipe[0], POLLIN, 0}, {listener, POLLIN, 0}};
+    if (::poll(fds, listener >= 0 ? 2 : 1, -1) < 0)
+      continue;
+
+    if (fds[0].revents) {
+      char requests[64];
+      ssize_t n = read(wake_pipe[0], requests, sizeof requests);
+      bool dump = false, quit = false;
+      for (ssize_t i = 0; i < n; ++i) {
+        dump |= requests[i] == 'd';
+        quit |= requests[i] == 'q';
+      }
+      if (quit)
+        return;
+      if (dump) {
+        std::ostringstream text;
+        write_metrics(collect_metrics(), text);
+        auto s = text.str();
+        [[maybe_unused]] auto written = write(STDERR_FILENO, s.data(), s.size());
+      }
+    }
+
+    if (listener >= 0 && fds[1].revents) {
+      int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client >= 0) {
+        answer(client);
+        close(client);
+      }
+    }
+  }
+}
+
+auto MetricsServer::answer(int client) -> void {
+  // take the request, if the client sends one, so that closing with it
+  // unread does not reset the connection under the response
+  pollfd request{client, POLLIN, 0};
+  if (::poll(&request, 1, 100) > 0) {
+    char buffer[4096];
+    [[maybe_unused]] auto n = read(client, buffer, sizeof buffer);
+  }
+
+  std::ostringstream body;
+  write_metrics(collect_metrics(), body);
+  auto text = body.str();
+  send_all(client, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: " +
+                       std::to_string(text.size()) + "\r\nConnection: close\r\n\r\n" + text);
+}
+
+#endif
@@ -0,0 +1,227 @@
+#include "Profiler.h"
+#include "LC3.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+using std::ostream;
+using std::string;
+using std::vector;
+
+static auto hex(uint32_t value) -> string {
+  char text[8];
+  std::snprintf(text, sizeof text, "x%04X", static_cast<unsigned>(value & 0xffff));
+  return text;
+}
+
+static auto percent(uint64_t count, uint64_t total) -> double {
+  return total ? 100.0 * count / total : 0;
+}
+
+// the `top` items with the largest key, largest first
+template <typename T, typename Key>
+static auto hottest(const vector<T> &items, size_t top, Key key) -> vector<T> {
+  vector<T> result = items;
+  auto by_key = [&](const T &a, const T &b) { return key(a) > key(b); };
+  if (result.size() > top) {
+    std::partial_sort(result.begin(), result.begin() + top, result.end(), by_key);
+    result.resize(top);
+  } else {
+    std::sort(result.begin(), result.end(), by_key);
+  }
+  return result;
+}
+
+Profiler::Profiler(string report_path, string folded_path)
+    : report_path(std::move(report_path)), folded_path(std::move(folded_path)),
+      executions(VM::memory_size) {
+  nodes.push_back({VM::PC_START, 0});
+}
+
+auto Profiler::child(uint32_t parent, uint32_t frame) -> uint32_t {
+  uint64_t key = uint64_t(parent) << 32 | frame;
+  auto [it, added] = children.try_emplace(key, static_cast<uint32_t>(nodes.size()));
+  if (added)
+    nodes.push_back({frame, parent});
+  return it->second;
+}
+
+auto Profiler::call(uint16_t target, uint16_t return_address) -> void {
+  ++calls[target];
+  if (stack.size() == max_depth)
+    return;
+  stack.emplace_back(current, return_address);
+  current = child(current, target);
+}
+
+// a RET to some caller's return address unwinds to that caller; any other
+// JMP R7 is a plain jump and leaves the call tree alone
+auto Profiler::ret(uint16_t target) -> void {
+  for (size_t i = stack.size(); i-- > 0;) {
+    if (stack[i].second == target) {
+      current = stack[i].first;
+      stack.resize(i);
+      return;
+    }
+  }
+}
+
+auto Profiler::record(const VM &vm, uint16_t pc, uint16_t instruction) -> void {
+  ++total;
+  ++executions[pc];
+  ++opcodes[instruction >> 12];
+  // a TRAP counts in its own frame below the caller's (see below) only
+  if (instruction >> 12 != Opcodes::OP_TRAP)
+    ++nodes[current].self;
+
+  uint16_t next = vm.registers[Registers::R_PC];
+  switch (instruction >> 12) {
+  case Opcodes::OP_BR: {
+    uint16_t nzp = (instruction >> 9) & 0x7;
+    if (!nzp)
+      break;
+    // BR leaves the flags alone, so they still tell whether it was taken
+    auto &branch = branches[pc];
+    branch.target = pc + 1 + extend_sign(instruction & 0x1FF, 9);
+    if (nzp & vm.registers[Registers::R_COND])
+      ++branch.taken;
+    else
+      ++branch.not_taken;
+  } break;
+  case Opcodes::OP_JSR:
+    call(next, pc + 1);
+    break;
+  case Opcodes::OP_JMP:
+    if (((instruction >> 6) & 0x7) == Registers::R_R7)
+      ret(next);
+    break;
+  case Opcodes::OP_TRAP:
+    ++traps[instruction & 0xff];
+    ++nodes[child(current, trap_frame | (instruction & 0xff))].self;
+    break;
+  }
+}
+
+auto Profiler::path(uint32_t node) const -> string {
+  vector<uint32_t> frames;
+  for (; node != 0; node = nodes[node].parent)
+    frames.push_back(nodes[node].frame);
+  frames.push_back(nodes[0].frame);
+
+  string text;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    if (!text.empty())
+      text += ';';
+    text += *it & trap_frame ? "TRAP_x" + hex(*it).substr(3) : hex(*it);
+  }
+  return text;
+}
+
+auto Profiler::report(ostream &out, size_t top) const -> void {
+  auto flags = out.flags();
+  out << std::fixed << std::setprecision(1);
+  out << "profile: " << total << " instructions\n";
+
+  out << "\nopcodes\n";
+  for (int op = 0; op < 16; ++op)
+    if (opcodes[op])
+      out << "  " << std::left << std::setw(5) << opcode_names[op] << std::right
+          << std::setw(14) << opcodes[op] << std::setw(7) << percent(opcodes[op], total)
+          << "%\n";
+
+  out << "\ntrap vectors\n";
+  for (int vector = 0; vector < 256; ++vector)
+    if (traps[vector])
+      out << "  " << hex(vector).replace(1, 2, "") << std::setw(16) << traps[vector] << '\n';
+
+  vector<uint16_t> addresses;
+  for (uint32_t pc = 0; pc < VM::memory_size; ++pc)
+    if (executions[pc])
+      addresses.push_back(static_cast<uint16_t>(pc));
+  out << "\nhottest addresses\n";
+  for (auto pc : hottest(addresses, top, [&](uint16_t pc) { return executions[pc]; }))
+    out << "  " << hex(pc) << std::setw(14) << executions[pc] << std::setw(7)
+        << percent(executions[pc], total) << "%\n";
+
+  // a taken backward branch closes a loop running from its target to it
+  struct Loop {
+    uint16_t head, tail;
+    uint64_t iterations, instructions;
+  };
+  vector<Loop> loops;
+  for (const auto &[pc, branch] : branches) {
+    if (!branch.taken || branch.target > pc)
+      continue;
+    uint64_t instructions = 0;
+    for (uint32_t a = branch.target; a <= pc; ++a)
+      instructions += executions[a];
+    loops.push_back({branch.target, pc, branch.taken, instructions});
+  }
+  out << "\nhottest loops\n";
+  for (const auto &loop : hottest(loops, top, [](const Loop &l) { return l.instructions; }))
+    out << "  " << hex(loop.head) << "-" << hex(loop.tail) << std::setw(14) << loop.iterations
+        << " iterations" << std::setw(14) << loop.instructions << " instructions"
+        << std::setw(7) << percent(loop.instructions, total) << "%\n";
+
+  // inclusive counts: every node adds into its parent, children come later;
+  // a recursive call is only counted at its outermost frame
+  vector<uint64_t> inclusive(nodes.size());
+  for (uint32_t node = static_cast<uint32_t>(nodes.size()); node-- > 1;) {
+    inclusive[node] += nodes[node].self;
+    inclusive[nodes[node].parent] += inclusive[node];
+  }
+  std::unordered_map<uint32_t, uint64_t> subroutine_total;
+  for (uint32_t node = 1; node < nodes.size(); ++node) {
+    bool outermost = true;
+    for (uint32_t up = nodes[node].parent; up != 0 && outermost; up = nodes[up].parent)
+      outermost = nodes[up].frame != nodes[node].frame;
+    if (outermost && !(nodes[node].frame & trap_frame))
+      subroutine_total[nodes[node].frame] += inclusive[node];
+  }
+  vector<std::pair<uint16_t, uint64_t>> subroutines(calls.begin(), calls.end());
+  out << "\nhottest subroutines\n";
+  for (auto [target, count] : hottest(subroutines, top, [&](const auto &s) {
+         return subroutine_total[s.first];
+       }))
+    out << "  " << hex(target) << std::setw(14) << count << " calls" << std::setw(14)
+        << subroutine_total[target] << " instructions" << std::setw(7)
+        << percent(subroutine_total[target], total) << "%\n";
+
+  vector<std::pair<uint16_t, Branch>> edges(branches.begin(), branches.end());
+  out << "\nbranches\n";
+  for (const auto &[pc, branch] :
+       hottest(edges, top, [](const auto &e) { return e.second.taken + e.second.not_taken; }))
+    out << "  " << hex(pc) << " -> " << hex(branch.target) << std::setw(14) << branch.taken
+        << " taken" << std::setw(14) << branch.not_taken << " not taken\n";
+
+  out.flags(flags);
+}
+
+auto Profiler::folded(ostream &out) const -> void {
+  for (uint32_t node = 0; node < nodes.size(); ++node)
+    if (nodes[node].self)
+      out << path(node) << ' ' << nodes[node].self << '\n';
+}
+
+template <typename Emit>
+static auto write_to(const string &path, Emit emit) -> void {
+  if (path.empty())
+    return;
+  if (path == "-") {
+    emit(std::cerr);
+    return;
+  }
+  std::ofstream file(path);
+  if (file)
+    emit(file);
+  else
+    std::cerr << "failed to write profile: " << path << '\n';
+}
+
+auto Profiler::write() const -> void {
+  write_to(report_path, [this](ostream &out) { report(out); });
+  write_to(folded_path, [this](ostream &out) { folded(out); });
+}
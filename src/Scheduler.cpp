@@ -0,0 +1,242 @@
+#include "Scheduler.h"
+#include "Input.h"
+#include "LC3.h"
+#include "Metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#else
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+using std::vector;
+
+struct Scheduler::Guest {
+  std::unique_ptr<VM> vm;
+  InputQueue input; // fed by the I/O thread
+  int fd;
+  bool closed = false; // input has ended; I/O thread only
+  bool parked = false;
+  bool done = false;
+  std::chrono::steady_clock::time_point parked_at;
+};
+
+Scheduler::Scheduler(unsigned threads, uint64_t slice)
+    : thread_count(std::max(threads, 1u)), slice(std::max<uint64_t>(slice, 1)) {
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (pipe(wake_pipe) != 0)
+    wake_pipe[0] = wake_pipe[1] = -1;
+#endif
+}
+
+Scheduler::~Scheduler() {
+#if !defined(_WIN32) && !defined(_WIN64)
+  if (wake_pipe[0] >= 0) {
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+  }
+#endif
+}
+
+auto Scheduler::add(std::unique_ptr<VM> vm, int input_fd) -> void {
+  auto guest = std::make_unique<Guest>();
+  guest->vm = std::move(vm);
+  guest->fd = input_fd;
+  guest->vm->set_input_queue(&guest->input);
+  guest->vm->start();
+  if (input_fd < 0) {
+    guest->input.close();
+    guest->closed = true;
+  }
+  guests.push_back(std::move(guest));
+}
+
+auto Scheduler::run() -> Stats {
+  live = guests.size();
+  for (auto &guest : guests)
+    runnable.push_back(guest.get());
+
+  std::thread reader([this] { io(); });
+  vector<std::thread> workers;
+  for (unsigned i = 0; i < thread_count; ++i)
+    workers.emplace_back([this] { worker(); });
+  for (auto &t : workers)
+    t.join();
+  reader.join();
+
+  Stats stats;
+  stats.slices = slices;
+  stats.parks = parks;
+  for (auto &guest : guests) {
+    stats.instructions += guest->vm->retired;
+    guest->vm->set_input_queue(nullptr);
+  }
+  return stats;
+}
+
+auto Scheduler::worker() -> void {
+  for (;;) {
+    Guest *guest;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      work.wait(guard, [this] { return !runnable.empty() || live == 0; });
+      if (runnable.empty())
+        return;
+      guest = runnable.front();
+      runnable.pop_front();
+    }
+
+    auto status = guest->vm->run_for(slice);
+    slices.fetch_add(1, std::memory_order_relaxed);
+    // a prompt shows up before the guest waits for its answer
+    if (status != RunStatus::Budget)
+      guest->vm->flush_output();
+
+    std::lock_guard<std::mutex> guard(lock);
+    switch (status) {
+    case RunStatus::Budget:
+      runnable.push_back(guest);
+      break;
+    case RunStatus::Input:
+      // keys fed before the I/O thread took the lock are seen here; later
+      // ones find the guest parked
+      if (guest->input.ready() || guest->input.exhausted()) {
+        runnable.push_back(guest);
+      } else {
+        guest->parked = true;
+        guest->parked_at = std::chrono::steady_clock::now();
+        parks.fetch_add(1, std::memory_order_relaxed);
+      }
+      break;
+    case RunStatus::Halted:
+      guest->done = true;
+      if (--live == 0) {
+        work.notify_all();
+        wake_io();
+      }
+      break;
+    }
+  }
+}
+
+auto Scheduler::unpark(Guest &guest) -> void {
+  guest.parked = false;
+  auto parked_for = std::chrono::steady_clock::now() - guest.parked_at;
+  Counters::add(Counters::local().input_wait_ns,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(parked_for).count());
+}
+
+auto Scheduler::wake_io() -> void {
+#if !defined(_WIN32) && !defined(_WIN64)
+  char c = 0;
+  [[maybe_unused]] auto n = write(wake_pipe[1], &c, 1);
+#endif
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+
+// no poll() for arbitrary descriptors: inputs are read one after the other,
+// which suits the regular files batch-style runs use
+auto Scheduler::io() -> void {
+  auto &counters = Counters::local();
+  char buffer[4096];
+  for (auto &guest : guests) {
+    while (!guest->closed) {
+      int n = _read(guest->fd, buffer, static_cast<unsigned>(std::min(
+                                           guest->input.space(), sizeof buffer)));
+      if (n <= 0) {
+        guest->input.close();
+        guest->closed = true;
+      } else {
+        for (int fed = 0; fed < n; std::this_thread::yield())
+          fed += static_cast<int>(guest->input.feed(buffer + fed, n - fed));
+      }
+      Counters::add(counters.syscalls);
+      std::lock_guard<std::mutex> guard(lock);
+      if (guest->parked) {
+        unpark(*guest);
+        runnable.push_back(guest.get());
+        work.notify_one();
+      }
+    }
+  }
+}
+
+#else
+
+auto Scheduler::io() -> void {
+  auto &counters = Counters::local();
+  vector<pollfd> fds;
+  vector<Guest *> polled, fed;
+  char buffer[4096];
+
+  for (;;) {
+    fds.clear();
+    polled.clear();
+    bool full = false; // some guest has no room for keys right now
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (live == 0)
+        return;
+      for (auto &guest : guests) {
+        if (guest->done || guest->closed)
+          continue;
+        if (!guest->input.space()) {
+          full = true;
+          continue;
+        }
+        fds.push_back({guest->fd, POLLIN, 0});
+        polled.push_back(guest.get());
+      }
+    }
+    fds.push_back({wake_pipe[0], POLLIN, 0});
+
+    // a full guest is polled again once it has had time to consume
+    int ready = ::poll(fds.data(), fds.size(), full ? 10 : -1);
+    Counters::add(counters.syscalls);
+    if (ready < 0)
+      continue;
+    if (fds.back().revents) {
+      char drain[64];
+      [[maybe_unused]] auto n = read(wake_pipe[0], drain, sizeof drain);
+      Counters::add(counters.syscalls);
+    }
+
+    fed.clear();
+    for (size_t i = 0; i < polled.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+      Guest *guest = polled[i];
+      ssize_t n = read(guest->fd, buffer, std::min(guest->input.space(), sizeof buffer));
+      Counters::add(counters.syscalls);
+      if (n > 0) {
+        guest->input.feed(buffer, static_cast<size_t>(n));
+      } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        guest->input.close();
+        guest->closed = true;
+      } else {
+        continue;
+      }
+      fed.push_back(guest);
+    }
+
+    if (fed.empty())
+      continue;
+    std::lock_guard<std::mutex> guard(lock);
+    for (Guest *guest : fed) {
+      if (guest->parked) {
+        unpark(*guest);
+        runnable.push_back(guest);
+      }
+    }
+    work.notify_all();
+  }
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include "Snapshot.h"
+#include "LC3.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using namespace SnapshotFormat;
+using std::vector;
+
+static_assert(pages == 64, "the page map is one 64-bit word");
+
+auto save_snapshot(const VM &vm, const char *path) -> bool {
+  auto file =
+      std::unique_ptr<std::FILE, decltype(&fclose)>(std::fopen(path, "wb"), std::fclose);
+  if (!file)
+    return false;
+
+  // everything after the magic is a sequence of big-endian words
+  vector<uint16_t> words(vm.registers.begin(), vm.registers.end());
+  uint64_t present = 0;
+  for (uint32_t page = 0; page < pages; ++page) {
+    auto first = vm.memory.begin() + page * page_words;
+    if (std::any_of(first, first + page_words, [](uint16_t w) { return w != 0; }))
+      present |= uint64_t(1) << page;
+  }
+  for (int shift = 48; shift >= 0; shift -= 16)
+    words.push_back(static_cast<uint16_t>(present >> shift));
+  for (uint32_t page = 0; page < pages; ++page)
+    if (present >> page & 1)
+      words.insert(words.end(), vm.memory.begin() + page * page_words,
+                   vm.memory.begin() + (page + 1) * page_words);
+
+  for (auto &w : words)
+    w = swap_16(w);
+  std::fwrite(magic, 1, sizeof magic, file.get());
+  std::fwrite(words.data(), sizeof(uint16_t), words.size(), file.get());
+  return std::fflush(file.get()) == 0 && !std::ferror(file.get());
+}
+
+auto is_snapshot(const uint8_t *bytes, size_t size) -> bool {
+  return size >= sizeof magic && !std::memcmp(bytes, magic, sizeof magic);
+}
+
+auto read_snapshot(VM &vm, const uint8_t *bytes, size_t size) -> bool {
+  constexpr size_t header_words = Registers::R_COUNT + 4;
+  if (!is_snapshot(bytes, size) || size < sizeof magic + 2 * header_words)
+    return false;
+  uint16_t header[header_words];
+  swap_words(header, bytes + sizeof magic, header_words);
+
+  uint64_t present = 0;
+  for (size_t i = Registers::R_COUNT; i < header_words; ++i)
+    present = present << 16 | header[i];
+  const uint8_t *page_data = bytes + sizeof magic + 2 * header_words;
+  size_t page_count = std::popcount(present);
+  if (size - (page_data - bytes) < page_count * page_words * 2)
+    return false;
+
+  vm.memory.fill(0);
+  for (uint32_t page = 0; page < pages; ++page) {
+    if (present >> page & 1) {
+      swap_words(&vm.memory[page * page_words], page_data, page_words);
+      page_data += page_words * 2;
+    }
+  }
+  std::copy(header, header + Registers::R_COUNT, vm.registers.begin());
+  vm.resume = true;
+  return true;
+}
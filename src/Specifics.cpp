@@ -1,17 +1,23 @@
 #include "Specifics.h"
 #include <cstdint>
+#include <cstdio>
 
 #if defined(_WIN32) || defined(_WIN64)
 
 #include <Windows.h>
 #include <conio.h>
+#include <io.h>
 
 HANDLE handle = INVALID_HANDLE_VALUE;
 DWORD fdw_mode, fdw_old_mode;
+static bool raw_mode = false;
 
+// only a console is switched; redirected input is left untouched
 auto disable_input_buffering() -> void {
   handle = GetStdHandle(STD_INPUT_HANDLE);
-  GetConsoleMode(handle, &fdw_old_mode);      /* save old mode */
+  if (!GetConsoleMode(handle, &fdw_old_mode)) /* save old mode */
+    return;
+  raw_mode = true;
   fdw_mode = fdw_old_mode ^ ENABLE_ECHO_INPUT /* no input echo */
              ^ ENABLE_LINE_INPUT;             /* return when one or
                                                more characters are available */
@@ -19,33 +25,62 @@ auto disable_input_buffering() -> void {
   FlushConsoleInputBuffer(handle);            /* clear buffer */
 }
 
-auto restore_input_buffering() -> void { SetConsoleMode(handle, fdw_old_mode); }
+auto restore_input_buffering() -> void {
+  if (raw_mode)
+    SetConsoleMode(handle, fdw_old_mode);
+}
 
 auto check_key() -> uint16_t {
   return WaitForSingleObject(handle, 1000) == WAIT_OBJECT_0 && _kbhit();
 }
 
+auto is_terminal(std::FILE *file) -> bool { return _isatty(_fileno(file)); }
+
+auto read_char(std::FILE *file) -> int { return _getc_nolock(file); }
+
+// images are small enough that reading them costs about what mapping would
+FileView::FileView(const char *path) {
+  std::FILE *file = std::fopen(path, "rb");
+  if (!file)
+    return;
+  uint8_t buffer[1 << 16];
+  for (size_t n; (n = std::fread(buffer, 1, sizeof buffer, file)) > 0;)
+    copy.insert(copy.end(), buffer, buffer + n);
+  opened = !std::ferror(file);
+  std::fclose(file);
+  bytes = copy.data();
+  length = copy.size();
+}
+
+FileView::~FileView() = default;
+
 #elif defined(__linux__) || defined(__unix__)
 
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 static struct termios original_tio;
+static bool raw_mode = false;
 
+// only a terminal is switched to raw mode; a file or pipe is left untouched
 auto disable_input_buffering() -> void {
-  tcgetattr(STDIN_FILENO, &original_tio);
+  if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original_tio) != 0)
+    return;
+  raw_mode = true;
   struct termios new_tio = original_tio;
   new_tio.c_lflag &= ~ICANON & ~ECHO;
   tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
 }
 
 auto restore_input_buffering() -> void {
-  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+  if (raw_mode)
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
 }
 
 auto check_key() -> uint16_t {
@@ -58,4 +93,56 @@ auto check_key() -> uint16_t {
   timeout.tv_usec = 0;
   return select(1, &readfds, NULL, NULL, &timeout) != 0;
 }
+
+auto is_terminal(std::FILE *file) -> bool { return isatty(fileno(file)); }
+
+auto read_char(std::FILE *file) -> int { return getc_unlocked(file); }
+
+FileView::FileView(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  // below a few pages, one read() is cheaper than setting up a mapping
+  constexpr off_t map_threshold = 1 << 16;
+  struct stat st {};
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= map_threshold) {
+#if defined(MAP_POPULATE)
+    int flags = MAP_PRIVATE | MAP_POPULATE;
+#else
+    int flags = MAP_PRIVATE;
+#endif
+    void *p = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    if (p != MAP_FAILED) {
+      mapping = p;
+      bytes = static_cast<const uint8_t *>(p);
+      length = st.st_size;
+      opened = true;
+      close(fd);
+      return;
+    }
+  }
+
+  // small files, pipes and devices
+  copy.resize(S_ISREG(st.st_mode) ? st.st_size + 1 : 1 << 16);
+  size_t filled = 0;
+  for (;;) {
+    ssize_t n = read(fd, copy.data() + filled, copy.size() - filled);
+    if (n <= 0) {
+      opened = n == 0;
+      break;
+    }
+    filled += n;
+    if (filled == copy.size())
+      copy.resize(2 * filled);
+  }
+  close(fd);
+  copy.resize(filled);
+  bytes = copy.data();
+  length = copy.size();
+}
+
+FileView::~FileView() {
+  if (mapping)
+    munmap(mapping, length);
+}
 #endif
\ No newline at end of file
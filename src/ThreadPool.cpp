@@ -0,0 +1,86 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned thread_count) {
+  if (thread_count == 0)
+    thread_count = 1;
+
+  for (unsigned i = 0; i < thread_count; ++i)
+    queues.push_back(std::make_unique<Queue>());
+
+  for (unsigned i = 0; i < thread_count; ++i)
+    workers.emplace_back([this, i] { worker(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  wait();
+  {
+    std::lock_guard<std::mutex> guard(state_lock);
+    stopping = true;
+  }
+  work_ready.notify_all();
+  for (auto &t : workers)
+    t.join();
+}
+
+auto ThreadPool::submit(Task task) -> void {
+  // round-robin placement; stealing evens out whatever imbalance is left
+  auto &q = *queues[next_queue++ % queues.size()];
+  pending++;
+  {
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> guard(state_lock);
+    queued++;
+  }
+  work_ready.notify_one();
+}
+
+auto ThreadPool::wait() -> void {
+  std::unique_lock<std::mutex> guard(state_lock);
+  all_done.wait(guard, [this] { return pending == 0; });
+}
+
+auto ThreadPool::take(unsigned id, Task &task) -> bool {
+  {
+    auto &own = *queues[id];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < queues.size(); ++i) {
+    auto &victim = *queues[(id + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+auto ThreadPool::worker(unsigned id) -> void {
+  for (;;) {
+    Task task;
+    if (take(id, task)) {
+      queued--;
+      task();
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        all_done.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(state_lock);
+    work_ready.wait(guard, [this] { return stopping || queued > 0; });
+    if (stopping && queued == 0)
+      return;
+  }
+}
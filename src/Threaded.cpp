@@ -0,0 +1,506 @@
+#include "Threaded.h"
+#include "LC3.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+
+using std::unique_ptr;
+
+// executions of each fused handler, summed over all runs
+static std::atomic<uint64_t> fusions_fired[Fusions::COUNT];
+
+auto decode(uint16_t address, uint16_t instruction) -> Decoded {
+  Decoded d{Handlers::OTHER, 0, 0, 0, 0, instruction};
+  uint16_t next = address + 1;
+
+  d.r0 = (instruction >> 9) & 0x7;
+  d.r1 = (instruction >> 6) & 0x7;
+  d.r2 = instruction & 0x7;
+
+  switch (instruction >> 12) {
+  case Opcodes::OP_ADD:
+  case Opcodes::OP_AND: {
+    bool is_add = (instruction >> 12) == Opcodes::OP_ADD;
+    if ((instruction >> 5) & 0x1) {
+      d.handler = is_add ? Handlers::ADD_IMM : Handlers::AND_IMM;
+      d.imm = extend_sign(instruction & 0x1F, 5);
+    } else {
+      d.handler = is_add ? Handlers::ADD_REG : Handlers::AND_REG;
+    }
+  } break;
+  case Opcodes::OP_NOT:
+    d.handler = Handlers::NOT;
+    break;
+  case Opcodes::OP_BR:
+    d.imm = next + extend_sign(instruction & 0x1FF, 9);
+    d.handler = d.r0 == 0x7 ? Handlers::BR_ALWAYS
+                : d.r0 == 0 ? Handlers::NOP
+                            : Handlers::BR;
+    break;
+  case Opcodes::OP_JMP:
+    d.handler = Handlers::JMP;
+    break;
+  case Opcodes::OP_JSR:
+    if ((instruction >> 11) & 1) {
+      d.handler = Handlers::JSR;
+      d.imm = next + extend_sign(instruction & 0x7FF, 11);
+    } else {
+      d.handler = Handlers::JSRR;
+    }
+    break;
+  case Opcodes::OP_LD:
+    d.handler = Handlers::LD;
+    d.imm = next + extend_sign(instruction & 0x1FF, 9);
+    break;
+  case Opcodes::OP_LDI:
+    d.handler = Handlers::LDI;
+    d.imm = next + extend_sign(instruction & 0x1FF, 9);
+    break;
+  case Opcodes::OP_LDR:
+    d.handler = Handlers::LDR;
+    d.imm = extend_sign(instruction & 0x3F, 6);
+    break;
+  case Opcodes::OP_LEA:
+    d.handler = Handlers::LEA;
+    d.imm = next + extend_sign(instruction & 0x1FF, 9);
+    break;
+  case Opcodes::OP_ST:
+    d.handler = Handlers::ST;
+    d.imm = next + extend_sign(instruction & 0x1FF, 9);
+    break;
+  case Opcodes::OP_STI:
+    d.handler = Handlers::STI;
+    d.imm = next + extend_sign(instruction & 0x1FF, 9);
+    break;
+  case Opcodes::OP_STR:
+    d.handler = Handlers::STR;
+    d.imm = extend_sign(instruction & 0x3F, 6);
+    break;
+  case Opcodes::OP_TRAP:
+    d.handler = Handlers::TRAP;
+    d.imm = instruction & 0xFF;
+    break;
+  }
+  return d;
+}
+
+auto writes_flags(const Decoded &d) -> bool {
+  switch (d.handler) {
+  case Handlers::ADD_REG:
+  case Handlers::ADD_IMM:
+  case Handlers::AND_REG:
+  case Handlers::AND_IMM:
+  case Handlers::NOT:
+  case Handlers::LEA:
+  case Handlers::LD:
+  case Handlers::LDI:
+  case Handlers::LDR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// the flags `d` sets are dead when the straight-line code after it sets
+// them again before anything can read them. the scan stays within the
+// words a store to any of them invalidates `d` for, and gives up at a
+// branch, jump, TRAP or RTI, and at a store that could reach the scanned
+// code or the device page (MCR can stop the guest in between)
+auto elide_flags(Decoded &d, uint16_t address, const uint16_t *memory) -> void {
+  bool dead = false;
+  for (uint16_t i = 1; i < DECODE_WINDOW && !dead; ++i) {
+    uint16_t at = address + i;
+    Decoded n = decode(at, memory[at]);
+    if (writes_flags(n))
+      dead = true;
+    else if (n.handler == Handlers::NOP)
+      continue;
+    else if (n.handler != Handlers::ST || n.imm >= MappedReg::IO_PAGE ||
+             static_cast<uint16_t>(n.imm - address) < DECODE_WINDOW)
+      return;
+  }
+  if (!dead)
+    return;
+
+  switch (d.handler) {
+  case Handlers::ADD_REG:
+    d.handler = Handlers::ADD_REG_NF;
+    break;
+  case Handlers::ADD_IMM:
+    d.handler = Handlers::ADD_IMM_NF;
+    break;
+  case Handlers::AND_REG:
+    d.handler = Handlers::AND_REG_NF;
+    break;
+  case Handlers::AND_IMM:
+    d.handler = Handlers::AND_IMM_NF;
+    break;
+  case Handlers::NOT:
+    d.handler = Handlers::NOT_NF;
+    break;
+  case Handlers::LEA:
+    d.handler = Handlers::LEA_NF;
+    break;
+  }
+}
+
+auto fuse(Decoded &d, uint16_t address, const uint16_t *memory) -> void {
+  Decoded n1 = decode(address + 1, memory[static_cast<uint16_t>(address + 1)]);
+  Decoded n2 = decode(address + 2, memory[static_cast<uint16_t>(address + 2)]);
+
+  // LDR Ra, Rb, #o; ADD Ra, Ra, #i; STR Ra, Rb, #o
+  if (d.handler == Handlers::LDR && d.r0 != d.r1 && n1.handler == Handlers::ADD_IMM &&
+      n1.r0 == d.r0 && n1.r1 == d.r0 && n2.handler == Handlers::STR &&
+      n2.r0 == d.r0 && n2.r1 == d.r1 && n2.imm == d.imm) {
+    d.handler = Handlers::LDR_ADD_STR;
+    d.r2 = static_cast<uint8_t>(n1.imm); // imm5 survives the narrowing
+    return;
+  }
+  // AND Rx, Ry, #0; ADD Rx, Rx, #i
+  if (d.handler == Handlers::AND_IMM && d.imm == 0 && n1.handler == Handlers::ADD_IMM &&
+      n1.r0 == d.r0 && n1.r1 == d.r0) {
+    d.handler = Handlers::CONST;
+    d.imm = n1.imm;
+    return;
+  }
+  // ADD Rx, Ry, #i; BR(nzp) target
+  if (d.handler == Handlers::ADD_IMM && n1.handler == Handlers::BR) {
+    d.handler = Handlers::ADD_BR;
+    d.r2 = n1.r0;
+    d.raw = n1.imm;
+    return;
+  }
+  // LEA R0, string; TRAP x22
+  if (d.handler == Handlers::LEA && d.r0 == Registers::R_R0 &&
+      n1.handler == Handlers::TRAP && n1.imm == TrapCodes::TRAP_PUTS) {
+    d.handler = Handlers::LEA_PUTS;
+    d.raw = n1.raw;
+  }
+}
+
+auto report_fusions(std::ostream &out) -> void {
+  static const char *const names[Fusions::COUNT] = {
+      "AND+ADD (constant)", "ADD+BR (counted loop)", "LDR+ADD+STR (read-modify-write)",
+      "LEA+PUTS (string output)"};
+  for (int i = 0; i < Fusions::COUNT; ++i)
+    out << names[i] << ": " << fusions_fired[i] << '\n';
+}
+
+#if defined(__GNUC__)
+// labels-as-values is a GNU extension; it is what makes this engine threaded
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define LC3_COMPUTED_GOTO 1
+#endif
+
+// with lazy_flags the engine keeps the last flag-setting result instead of
+// R_COND and derives N/Z/P from it only where they are read; the decoder
+// also drops flag updates that the next instruction overwrites. with fused
+// the decoder merges common instruction sequences into one handler.
+template <bool lazy_flags, bool fused> static auto execute(VM &vm) -> void {
+  auto table = unique_ptr<Decoded[]>(new Decoded[VM::memory_size]());
+  vm.decoded = table.get();
+
+  auto &reg = vm.registers;
+  vm.start();
+  uint16_t last = 0;    // lazy_flags: the value R_COND is derived from
+  uint64_t retired = 0; // not yet added to vm.retired
+
+  auto cc = [&reg, &last](uint16_t value) {
+    if constexpr (lazy_flags)
+      last = value;
+    else
+      reg[Registers::R_COND] = flags_of(value);
+  };
+  auto flags = [&reg, &last]() -> uint16_t {
+    if constexpr (lazy_flags)
+      return flags_of(last);
+    else
+      return reg[Registers::R_COND];
+  };
+  // hands the flags and the instruction count to code outside the engine,
+  // and takes the flags back after it, e.g. TRAP GETC sets R_COND through
+  // VM::update_flags
+  auto materialize = [&vm, &reg, &flags, &retired]() {
+    reg[Registers::R_COND] = flags();
+    vm.retired += retired;
+    retired = 0;
+  };
+  auto reload = [&reg, &last]() {
+    if constexpr (lazy_flags)
+      last = reg[Registers::R_COND] == Flags::FL_ZRO   ? 0
+             : reg[Registers::R_COND] == Flags::FL_NEG ? 0x8000
+                                                       : 1;
+  };
+
+  uint16_t pc = reg[Registers::R_PC];
+  uint64_t fired[Fusions::COUNT] = {};
+  const Decoded *d = nullptr;
+  reload();
+
+#if LC3_COMPUTED_GOTO
+  static const void *const dispatch_table[Handlers::COUNT] = {
+      &&op_DECODE, &&op_ADD_REG, &&op_ADD_IMM, &&op_AND_REG, &&op_AND_IMM,
+      &&op_NOT,    &&op_BR,      &&op_BR_ALWAYS, &&op_NOP,   &&op_JMP,
+      &&op_JSR,    &&op_JSRR,    &&op_LD,      &&op_LDI,     &&op_LDR,
+      &&op_LEA,    &&op_ST,      &&op_STI,     &&op_STR,     &&op_TRAP,
+      &&op_OTHER,  &&op_ADD_REG_NF, &&op_ADD_IMM_NF, &&op_AND_REG_NF,
+      &&op_AND_IMM_NF, &&op_NOT_NF, &&op_LEA_NF, &&op_CONST, &&op_ADD_BR,
+      &&op_LDR_ADD_STR, &&op_LEA_PUTS};
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    d = &table[pc++];                                                          \
+    ++retired;                                                                 \
+    goto *dispatch_table[d->handler];                                          \
+  } while (0)
+#define HANDLER(name) op_##name:
+#define NEXT() DISPATCH()
+#else
+#define HANDLER(name) case Handlers::name:
+#define NEXT() continue
+#endif
+// every loop passes a taken branch or a jump, where SIGINT is checked
+#define JUMP()                                                                 \
+  if (interrupt_requested.load(std::memory_order_relaxed)) [[unlikely]]       \
+    goto interrupted;                                                          \
+  NEXT()
+
+#if LC3_COMPUTED_GOTO
+  DISPATCH();
+#else
+  for (;;) {
+    d = &table[pc++];
+    ++retired;
+    switch (d->handler) {
+#endif
+
+  HANDLER(DECODE) {
+    // first visit (or the word was overwritten): decode and re-dispatch
+    uint16_t address = pc - 1;
+    table[address] = decode(address, vm.memory[address]);
+    if constexpr (fused)
+      fuse(table[address], address, vm.memory.data());
+    if constexpr (lazy_flags)
+      elide_flags(table[address], address, vm.memory.data());
+    --retired;
+    pc = address;
+    NEXT();
+  }
+  HANDLER(ADD_REG) {
+    reg[d->r0] = reg[d->r1] + reg[d->r2];
+    cc(reg[d->r0]);
+    NEXT();
+  }
+  HANDLER(ADD_IMM) {
+    reg[d->r0] = reg[d->r1] + d->imm;
+    cc(reg[d->r0]);
+    NEXT();
+  }
+  HANDLER(AND_REG) {
+    reg[d->r0] = reg[d->r1] & reg[d->r2];
+    cc(reg[d->r0]);
+    NEXT();
+  }
+  HANDLER(AND_IMM) {
+    reg[d->r0] = reg[d->r1] & d->imm;
+    cc(reg[d->r0]);
+    NEXT();
+  }
+  HANDLER(NOT) {
+    reg[d->r0] = ~reg[d->r1];
+    cc(reg[d->r0]);
+    NEXT();
+  }
+  HANDLER(BR) {
+    if (d->r0 & flags()) {
+      pc = d->imm;
+      JUMP();
+    }
+    NEXT();
+  }
+  HANDLER(BR_ALWAYS) {
+    pc = d->imm;
+    JUMP();
+  }
+  HANDLER(NOP) { NEXT(); }
+  HANDLER(JMP) {
+    pc = reg[d->r1];
+    JUMP();
+  }
+  HANDLER(JSR) {
+    reg[Registers::R_R7] = pc;
+    pc = d->imm;
+    JUMP();
+  }
+  HANDLER(JSRR) {
+    uint16_t target = reg[d->r1];
+    reg[Registers::R_R7] = pc;
+    pc = target;
+    JUMP();
+  }
+  HANDLER(LD) {
+    reg[d->r0] = vm.read_mem(d->imm);
+    cc(reg[d->r0]);
+    if (!vm.is_running)
+      goto halt;
+    NEXT();
+  }
+  HANDLER(LDI) {
+    reg[d->r0] = vm.read_mem(vm.read_mem(d->imm));
+    cc(reg[d->r0]);
+    if (!vm.is_running)
+      goto halt;
+    NEXT();
+  }
+  HANDLER(LDR) {
+    reg[d->r0] = vm.read_mem(reg[d->r1] + d->imm);
+    cc(reg[d->r0]);
+    if (!vm.is_running)
+      goto halt;
+    NEXT();
+  }
+  HANDLER(LEA) {
+    reg[d->r0] = d->imm;
+    cc(reg[d->r0]);
+    NEXT();
+  }
+  HANDLER(ST) {
+    vm.write_mem(d->imm, reg[d->r0]);
+    if (!vm.is_running) // MCR
+      goto halt;
+    NEXT();
+  }
+  HANDLER(STI) {
+    vm.write_mem(vm.read_mem(d->imm), reg[d->r0]);
+    if (!vm.is_running)
+      goto halt;
+    NEXT();
+  }
+  HANDLER(STR) {
+    vm.write_mem(reg[d->r1] + d->imm, reg[d->r0]);
+    if (!vm.is_running)
+      goto halt;
+    NEXT();
+  }
+  HANDLER(TRAP) {
+    reg[Registers::R_PC] = pc;
+    materialize();
+    vm.trap_routines(d->raw);
+    reload();
+    if (!vm.is_running)
+      goto halt;
+    pc = reg[Registers::R_PC]; // a guest routine or exception handler
+    NEXT();
+  }
+  HANDLER(ADD_REG_NF) {
+    reg[d->r0] = reg[d->r1] + reg[d->r2];
+    NEXT();
+  }
+  HANDLER(ADD_IMM_NF) {
+    reg[d->r0] = reg[d->r1] + d->imm;
+    NEXT();
+  }
+  HANDLER(AND_REG_NF) {
+    reg[d->r0] = reg[d->r1] & reg[d->r2];
+    NEXT();
+  }
+  HANDLER(AND_IMM_NF) {
+    reg[d->r0] = reg[d->r1] & d->imm;
+    NEXT();
+  }
+  HANDLER(NOT_NF) {
+    reg[d->r0] = ~reg[d->r1];
+    NEXT();
+  }
+  HANDLER(LEA_NF) {
+    reg[d->r0] = d->imm;
+    NEXT();
+  }
+  HANDLER(CONST) {
+    reg[d->r0] = d->imm;
+    cc(d->imm);
+    ++pc;
+    ++retired;
+    ++fired[Fusions::CONST];
+    NEXT();
+  }
+  HANDLER(ADD_BR) {
+    reg[d->r0] = reg[d->r1] + d->imm;
+    cc(reg[d->r0]);
+    ++retired;
+    ++fired[Fusions::ADD_BR];
+    if (d->r2 & flags()) {
+      pc = d->raw;
+      JUMP();
+    }
+    ++pc;
+    NEXT();
+  }
+  HANDLER(LDR_ADD_STR) {
+    uint16_t address = reg[d->r1] + d->imm;
+    reg[d->r0] = vm.read_mem(address);
+    cc(reg[d->r0]);
+    if (!vm.is_running)
+      goto halt;
+    reg[d->r0] += static_cast<int8_t>(d->r2);
+    cc(reg[d->r0]);
+    vm.write_mem(address, reg[d->r0]);
+    pc += 2;
+    retired += 2;
+    ++fired[Fusions::LDR_ADD_STR];
+    if (!vm.is_running)
+      goto halt;
+    NEXT();
+  }
+  HANDLER(LEA_PUTS) {
+    reg[Registers::R_R0] = d->imm;
+    cc(d->imm);
+    reg[Registers::R_PC] = ++pc;
+    ++retired;
+    ++fired[Fusions::LEA_PUTS];
+    materialize();
+    vm.trap_routines(d->raw);
+    reload();
+    if (!vm.is_running)
+      goto halt;
+    pc = reg[Registers::R_PC]; // a guest routine or exception handler
+    NEXT();
+  }
+  HANDLER(OTHER) {
+    reg[Registers::R_PC] = pc;
+    materialize();
+    vm.trap_routines(d->raw);
+    reload();
+    if (!vm.is_running)
+      goto halt;
+    pc = reg[Registers::R_PC]; // a guest routine or exception handler
+    NEXT();
+  }
+
+#if !LC3_COMPUTED_GOTO
+    }
+  }
+#endif
+
+interrupted:
+  vm.is_running = false;
+halt:
+  reg[Registers::R_PC] = pc;
+  materialize();
+  vm.decoded = nullptr;
+  if constexpr (fused)
+    for (int i = 0; i < Fusions::COUNT; ++i)
+      fusions_fired[i] += fired[i];
+}
+
+#if LC3_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+auto run_threaded(VM &vm) -> void { execute<false, false>(vm); }
+
+auto run_lazy(VM &vm) -> void { execute<true, false>(vm); }
+
+auto run_fused(VM &vm) -> void { execute<true, true>(vm); }
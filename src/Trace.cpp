@@ -0,0 +1,352 @@
+#include "Trace.h"
+#include "Specifics.h"
+
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+
+using std::string;
+
+TraceWriter::TraceWriter(std::FILE *out, size_t buffers)
+    : out(out), limit(buffers ? buffers : 1), active(new uint8_t[buffer_size]) {
+  thread = std::thread([this] { writer(); });
+}
+
+TraceWriter::~TraceWriter() {
+  flush();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  changed.notify_all();
+  thread.join();
+}
+
+auto TraceWriter::bytes(const void *data, size_t size) -> void {
+  auto p = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i)
+    byte(p[i]);
+}
+
+auto TraceWriter::hand_off() -> void {
+  std::unique_lock<std::mutex> guard(lock);
+  // the bound: a guest producing faster than the disk takes waits here
+  changed.wait(guard, [this] { return full.size() < limit; });
+  full.emplace_back(std::move(active), used);
+  if (!spare.empty()) {
+    active = std::move(spare.back());
+    spare.pop_back();
+  } else {
+    active.reset(new uint8_t[buffer_size]);
+  }
+  used = 0;
+  changed.notify_all();
+}
+
+auto TraceWriter::flush() -> void {
+  if (used)
+    hand_off();
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this] { return full.empty() && !writing; });
+  std::fflush(out);
+}
+
+auto TraceWriter::writer() -> void {
+  std::unique_lock<std::mutex> guard(lock);
+  for (;;) {
+    changed.wait(guard, [this] { return stopping || !full.empty(); });
+    if (full.empty())
+      return;
+    auto [buffer, size] = std::move(full.front());
+    full.pop_front();
+    writing = true;
+    guard.unlock();
+    std::fwrite(buffer.get(), 1, size, out);
+    guard.lock();
+    writing = false;
+    spare.push_back(std::move(buffer));
+    changed.notify_all();
+  }
+}
+
+// FNV-1a over memory and registers
+auto state_hash(const VM &vm) -> uint64_t {
+  uint64_t hash = 0xcbf29ce484222325;
+  auto mix = [&hash](uint16_t word) {
+    hash = (hash ^ (word & 0xff)) * 0x100000001b3;
+    hash = (hash ^ (word >> 8)) * 0x100000001b3;
+  };
+  for (uint16_t word : vm.memory)
+    mix(word);
+  for (uint16_t word : vm.registers)
+    mix(word);
+  return hash;
+}
+
+Recorder::Recorder(std::FILE *out, const VM &vm) : writer(out) {
+  writer.bytes(RecordFormat::magic, sizeof RecordFormat::magic);
+  writer.varint(state_hash(vm));
+}
+
+auto Recorder::end_run() -> void {
+  if (!run_count)
+    return;
+  writer.byte(run_value ? RecordFormat::POLL_READY : RecordFormat::POLL_EMPTY);
+  writer.varint(run_count);
+  run_count = 0;
+}
+
+auto Recorder::key(uint16_t c) -> void {
+  end_run();
+  writer.byte(RecordFormat::KEY);
+  writer.varint(c);
+}
+
+auto Recorder::timer(uint16_t ms) -> void {
+  end_run();
+  writer.byte(RecordFormat::TIMER);
+  writer.varint(ms);
+}
+
+auto Recorder::stop() -> void {
+  end_run();
+  writer.byte(RecordFormat::STOP);
+}
+
+auto Recorder::finish(const VM &vm) -> void {
+  if (finished)
+    return;
+  finished = true;
+  end_run();
+  writer.byte(RecordFormat::END);
+  writer.varint(vm.retired);
+  for (uint16_t r : vm.registers)
+    writer.varint(r);
+  writer.flush();
+}
+
+auto Replayer::open(const char *path, string &error) -> bool {
+  FileView file(path);
+  if (!file.ok()) {
+    error = "cannot read " + string(path);
+    return false;
+  }
+  if (file.size() < sizeof RecordFormat::magic ||
+      std::memcmp(file.data(), RecordFormat::magic, sizeof RecordFormat::magic)) {
+    error = string(path) + " is not a recording";
+    return false;
+  }
+  log.assign(file.data(), file.data() + file.size());
+  position = sizeof RecordFormat::magic;
+  hash = read_varint();
+
+  // every event but STOP has one operand before the end event
+  size_t first = position;
+  while (position < log.size()) {
+    uint8_t tag = log[position++];
+    if (tag == RecordFormat::END) {
+      length = read_varint();
+      break;
+    }
+    if (tag != RecordFormat::STOP)
+      read_varint();
+  }
+  position = first;
+  return true;
+}
+
+auto Replayer::read_varint() -> uint64_t {
+  uint64_t value = 0;
+  for (int shift = 0; position < log.size() && shift < 64; shift += 7) {
+    uint8_t b = log[position++];
+    value |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  return value;
+}
+
+// takes the next event, which has to be of kind `tag`; its operand is left
+// in `operand`
+auto Replayer::next(VM &vm, uint8_t tag) -> bool {
+  bool poll = tag == RecordFormat::POLL_EMPTY || tag == RecordFormat::POLL_READY;
+  if (poll && run_left) {
+    --run_left;
+    operand = run_tag == RecordFormat::POLL_READY;
+    return true;
+  }
+
+  if (!failed && !run_left && position < log.size()) {
+    uint8_t recorded = log[position];
+    bool recorded_poll =
+        recorded == RecordFormat::POLL_EMPTY || recorded == RecordFormat::POLL_READY;
+    if (poll ? recorded_poll : recorded == tag) {
+      ++position;
+      if (recorded_poll) {
+        run_tag = recorded;
+        run_left = read_varint() - 1;
+        operand = recorded == RecordFormat::POLL_READY;
+      } else {
+        operand = read_varint();
+      }
+      return true;
+    }
+  }
+
+  failed = true;
+  vm.is_running = false;
+  return false;
+}
+
+// the recorded run stopped right after this input; so does the replay
+auto Replayer::stop_if_recorded(VM &vm) -> void {
+  if (!run_left && position < log.size() && log[position] == RecordFormat::STOP) {
+    ++position;
+    vm.is_running = false;
+  }
+}
+
+auto Replayer::poll(VM &vm) -> uint16_t {
+  if (!next(vm, RecordFormat::POLL_EMPTY))
+    return 0;
+  uint16_t ready = static_cast<uint16_t>(operand);
+  stop_if_recorded(vm);
+  return ready;
+}
+
+auto Replayer::key(VM &vm) -> uint16_t {
+  if (!next(vm, RecordFormat::KEY))
+    return 0xffff;
+  uint16_t c = static_cast<uint16_t>(operand);
+  stop_if_recorded(vm);
+  return c;
+}
+
+auto Replayer::timer(VM &vm) -> uint16_t {
+  return next(vm, RecordFormat::TIMER) ? static_cast<uint16_t>(operand) : 0;
+}
+
+auto Replayer::verify(const VM &vm, string &error) const -> bool {
+  if (failed || run_left) {
+    error = "the guest asked for input the recording does not have after " +
+            std::to_string(vm.retired) + " instructions";
+    return false;
+  }
+  // the end event follows the last input
+  auto rest = *this;
+  if (rest.position >= rest.log.size() || rest.log[rest.position] != RecordFormat::END) {
+    error = "the recording ends early (interrupted run?)";
+    return false;
+  }
+  ++rest.position;
+  uint64_t retired = rest.read_varint();
+  bool same = retired == vm.retired;
+  for (uint16_t r : vm.registers)
+    same &= rest.read_varint() == r;
+  if (!same)
+    error = "final state differs from the recording (" + std::to_string(retired) +
+            " instructions recorded, " + std::to_string(vm.retired) + " replayed)";
+  return same;
+}
+
+// the address `instruction` at `pc` stores to, before it runs
+static auto store_address(const VM &vm, uint16_t pc, uint16_t instruction, uint16_t &address)
+    -> bool {
+  uint16_t next = pc + 1;
+  switch (instruction >> 12) {
+  case Opcodes::OP_ST:
+    address = next + extend_sign(instruction & 0x1ff, 9);
+    return true;
+  case Opcodes::OP_STI:
+    address = vm.memory[static_cast<uint16_t>(next + extend_sign(instruction & 0x1ff, 9))];
+    return true;
+  case Opcodes::OP_STR:
+    address = vm.registers[(instruction >> 6) & 0x7] + extend_sign(instruction & 0x3f, 6);
+    return true;
+  }
+  return false;
+}
+
+auto run_traced(VM &vm, TraceWriter &out, uint64_t until) -> void {
+  out.bytes(TraceFormat::magic, sizeof TraceFormat::magic);
+  uint16_t expected = vm.registers[Registers::R_PC];
+  out.varint(expected);
+
+  while (vm.is_running && vm.retired < until) {
+    auto before = vm.registers;
+    uint16_t pc = before[Registers::R_PC];
+    uint16_t instruction = vm.memory[pc];
+    uint16_t address;
+    bool store = store_address(vm, pc, instruction, address);
+    vm.step();
+
+    uint8_t changed = 0;
+    for (int r = 0; r < 8; ++r)
+      changed |= uint8_t(vm.registers[r] != before[r]) << r;
+    out.byte((pc != expected ? TraceFormat::JUMP : 0) | (store ? TraceFormat::STORE : 0) |
+             (changed ? TraceFormat::REGS : 0));
+    if (pc != expected)
+      out.varint(pc);
+    if (store) {
+      out.varint(address);
+      out.varint(vm.registers[(instruction >> 9) & 0x7]);
+    }
+    if (changed) {
+      out.byte(changed);
+      for (int r = 0; r < 8; ++r)
+        if (changed >> r & 1)
+          out.varint(vm.registers[r]);
+    }
+    expected = pc + 1;
+  }
+  out.flush();
+}
+
+auto dump_trace(const char *path, std::ostream &out) -> bool {
+  FileView file(path);
+  if (!file.ok() || file.size() < sizeof TraceFormat::magic ||
+      std::memcmp(file.data(), TraceFormat::magic, sizeof TraceFormat::magic))
+    return false;
+
+  const uint8_t *p = file.data() + sizeof TraceFormat::magic;
+  const uint8_t *end = file.data() + file.size();
+  auto varint = [&]() {
+    uint64_t value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+      uint8_t b = *p++;
+      value |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    return value;
+  };
+  auto hex = [&out](uint64_t value) -> std::ostream & {
+    return out << 'x' << std::hex << std::setw(4) << std::setfill('0') << value << std::dec;
+  };
+
+  uint16_t pc = static_cast<uint16_t>(varint());
+  for (uint64_t n = 0; p < end; ++n) {
+    uint8_t tag = *p++;
+    if (tag & TraceFormat::JUMP)
+      pc = static_cast<uint16_t>(varint());
+    out << n << ' ';
+    hex(pc);
+    if (tag & TraceFormat::STORE) {
+      uint64_t address = varint();
+      out << " [";
+      hex(address) << "]=";
+      hex(varint());
+    }
+    if (tag & TraceFormat::REGS && p < end) {
+      uint8_t changed = *p++;
+      for (int r = 0; r < 8; ++r)
+        if (changed >> r & 1) {
+          out << " R" << r << '=';
+          hex(varint());
+        }
+    }
+    out << '\n';
+    ++pc;
+  }
+  return true;
+}
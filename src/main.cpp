@@ -1,27 +1,500 @@
 #include "Specifics.h"
 #include "LC3.h"
+#include "AOT.h"
+#include "Batch.h"
+#include "Engine.h"
+#include "Input.h"
+#include "Metrics.h"
+#include "Profiler.h"
+#include "Scheduler.h"
+#include "Snapshot.h"
+#include "Threaded.h"
+#include "Trace.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <signal.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 using std::cout;
+using std::string;
+using std::vector;
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+constexpr int O_NONBLOCK = 0; // serve inputs are read in order there
+#endif
+
+static auto usage() -> void {
+  cout << "lc3 [--engine switch|threaded|lazy|fused|jit|lockstep] [--stats] "
+          "[--async-input] [--idle-wait ms] [--record log-file] [--os os-image] "
+          "[--metrics socket-path] [image-file] ... \n"
+       << "lc3 --headless [--input file] [--flush always|line|full] "
+          "[--buffer bytes] [options] [image-file] ...\n"
+       << "lc3 --profile report-file [--folded folded-file] [options] "
+          "[image-file] ...\n"
+       << "lc3 --batch [--engine name] [-j threads] [-o out-dir] [--metrics socket-path] "
+          "[image-file] ... [--inputs input-file ...]\n"
+       << "lc3 --serve [-j threads] [--slice instructions] [-o out-dir] "
+          "[--metrics socket-path] image-file --inputs input-file ...\n"
+       << "lc3 --snapshot snapshot-file [--at input|instructions] image-file ...\n"
+       << "lc3 --replay log-file [--until instructions] [--trace trace-file] "
+          "[--snapshot snapshot-file] image-file ...\n"
+       << "lc3 --dump-trace trace-file\n"
+       << "lc3 --aot [--emit-cpp] image-file -o output\n";
+  exit(2);
+}
+
+// SIGUSR1 dumps the metrics in every long-running mode; a socket path also
+// serves them to scrapers, with opcode counts
+static auto start_metrics(const char *socket_path) -> std::unique_ptr<MetricsServer> {
+  Counters::by_opcode = socket_path;
+  auto server = std::make_unique<MetricsServer>(socket_path);
+  if (!server->ok())
+    std::cerr << "failed to serve metrics on " << socket_path << '\n';
+  return server;
+}
+
+// each image (or each input of a single image) becomes one job whose console
+// output lands in <out-dir>/<image>.<job>.out
+static auto run_batch_mode(int argc, const char *argv[]) -> int {
+  unsigned threads = std::thread::hardware_concurrency();
+  std::filesystem::path out_dir = ".";
+  Engine engine = Engine::Switch;
+  const char *metrics_path = nullptr;
+  vector<string> images, inputs;
+
+  bool reading_inputs = false;
+  for (int i = 2; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-j") && i + 1 < argc)
+      threads = static_cast<unsigned>(std::stoul(argv[++i]));
+    else if (!std::strcmp(argv[i], "-o") && i + 1 < argc)
+      out_dir = argv[++i];
+    else if (!std::strcmp(argv[i], "--metrics") && i + 1 < argc)
+      metrics_path = argv[++i];
+    else if (!std::strcmp(argv[i], "--engine") && i + 1 < argc) {
+      if (!parse_engine(argv[++i], engine))
+        usage();
+    } else if (!std::strcmp(argv[i], "--inputs"))
+      reading_inputs = true;
+    else
+      (reading_inputs ? inputs : images).push_back(argv[i]);
+  }
+  if (images.empty() || (!inputs.empty() && images.size() != 1))
+    usage();
+
+  vector<BatchJob> jobs;
+  auto add_job = [&](const string &image, const string &input) {
+    auto name = std::filesystem::path(image).stem().string() + "." +
+                std::to_string(jobs.size()) + ".out";
+    jobs.push_back({image, input, (out_dir / name).string()});
+  };
+  if (inputs.empty())
+    for (const auto &image : images)
+      add_job(image, "");
+  else
+    for (const auto &input : inputs)
+      add_job(images.front(), input);
+
+  auto metrics = start_metrics(metrics_path);
+  auto result = run_batch(jobs, threads, engine);
+  std::cerr << result.jobs << " jobs, " << result.failed << " failed, "
+            << result.seconds << " s, " << result.jobs / result.seconds
+            << " jobs/s, " << result.instructions / result.seconds / 1e6 << " MIPS\n";
+  return result.failed ? 1 : 0;
+}
+
+// one time-sliced guest per input, all on -j threads; inputs may be FIFOs or
+// other streams that deliver keys over time. guest n writes to
+// <out-dir>/<image>.<n>.out
+static auto run_serve_mode(int argc, const char *argv[]) -> int {
+  unsigned threads = std::thread::hardware_concurrency();
+  uint64_t slice = 100000;
+  std::filesystem::path out_dir = ".";
+  const char *metrics_path = nullptr;
+  string image;
+  vector<string> inputs;
+
+  bool reading_inputs = false;
+  for (int i = 2; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-j") && i + 1 < argc)
+      threads = static_cast<unsigned>(std::stoul(argv[++i]));
+    else if (!std::strcmp(argv[i], "--slice") && i + 1 < argc)
+      slice = std::stoull(argv[++i]);
+    else if (!std::strcmp(argv[i], "-o") && i + 1 < argc)
+      out_dir = argv[++i];
+    else if (!std::strcmp(argv[i], "--metrics") && i + 1 < argc)
+      metrics_path = argv[++i];
+    else if (!std::strcmp(argv[i], "--inputs"))
+      reading_inputs = true;
+    else if (reading_inputs)
+      inputs.push_back(argv[i]);
+    else if (image.empty())
+      image = argv[i];
+    else
+      usage();
+  }
+  if (image.empty() || inputs.empty())
+    usage();
+
+  VM prototype(nullptr, nullptr);
+  if (!prototype.read_image(image.c_str())) {
+    std::cerr << "failed to load image: " << image << '\n';
+    return 1;
+  }
+
+  using file_ptr = std::unique_ptr<std::FILE, decltype(&fclose)>;
+  vector<file_ptr> outputs;
+  vector<int> fds;
+  Scheduler scheduler(threads, slice);
+  for (size_t n = 0; n < inputs.size(); ++n) {
+    auto name = std::filesystem::path(image).stem().string() + "." + std::to_string(n) + ".out";
+    file_ptr out(std::fopen((out_dir / name).string().c_str(), "wb"), std::fclose);
+    int fd = ::open(inputs[n].c_str(), O_RDONLY | O_NONBLOCK);
+    if (!out || fd < 0) {
+      std::cerr << "failed to open " << (out ? inputs[n] : (out_dir / name).string()) << '\n';
+      return 1;
+    }
+
+    auto vm = std::make_unique<VM>(prototype);
+    vm->set_io(nullptr, out.get());
+    vm->set_output_buffering(Flush::Full);
+    scheduler.add(std::move(vm), fd);
+    outputs.push_back(std::move(out));
+    fds.push_back(fd);
+  }
+
+  auto metrics = start_metrics(metrics_path);
+  auto start = std::chrono::steady_clock::now();
+  auto stats = scheduler.run();
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (int fd : fds)
+    ::close(fd);
+
+  std::cerr << inputs.size() << " guests, " << stats.slices << " slices, " << stats.parks
+            << " parks, " << seconds << " s, " << stats.instructions / seconds / 1e6
+            << " MIPS\n";
+  return 0;
+}
+
+// boots the images until the guest first waits for input (or for a number of
+// instructions) and saves its state; the snapshot loads like an image
+static auto run_snapshot_mode(int argc, const char *argv[]) -> int {
+  if (argc < 4)
+    usage();
+  const char *path = argv[2];
+  uint64_t at = 0; // 0: first wait for input
+  vector<const char *> images;
+  for (int i = 3; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--at") && i + 1 < argc) {
+      ++i;
+      at = std::strcmp(argv[i], "input") ? std::stoull(argv[i]) : 0;
+    } else
+      images.push_back(argv[i]);
+  }
+  if (images.empty())
+    usage();
+
+  auto vm = std::make_unique<VM>(nullptr, stdout);
+  for (const char *image : images) {
+    if (!vm->read_image(image)) {
+      std::cerr << "failed to load image: " << image << '\n';
+      return 1;
+    }
+  }
+
+  // a queue that never gets a key: the first TRAP GETC/IN or KBSR polling
+  // loop ends the run, with the guest ready to repeat it once restored
+  InputQueue no_input;
+  vm->set_input_queue(&no_input);
+  vm->set_output_buffering(Flush::Full);
+  vm->start();
+  auto status = vm->run_for(at ? at : std::numeric_limits<uint64_t>::max() - vm->retired);
+  vm->flush_output();
+  vm->set_input_queue(nullptr);
+
+  if (status == RunStatus::Halted) {
+    std::cerr << "the guest halted before the snapshot point\n";
+    return 1;
+  }
+  if (!save_snapshot(*vm, path)) {
+    std::cerr << "failed to write snapshot: " << path << '\n';
+    return 1;
+  }
+  std::cerr << "snapshot at x" << std::hex << vm->registers[Registers::R_PC] << std::dec
+            << " after " << vm->retired << " instructions\n";
+  return 0;
+}
+
+// reruns a recorded guest from its log, optionally stopping after a number
+// of instructions, writing the full instruction trace or saving a snapshot
+// of where it stopped
+static auto run_replay_mode(int argc, const char *argv[]) -> int {
+  if (argc < 4)
+    usage();
+  const char *log_path = argv[2];
+  uint64_t until = std::numeric_limits<uint64_t>::max();
+  const char *trace_path = nullptr;
+  const char *snapshot_path = nullptr;
+  vector<const char *> images;
+  for (int i = 3; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--until") && i + 1 < argc)
+      until = std::stoull(argv[++i]);
+    else if (!std::strcmp(argv[i], "--trace") && i + 1 < argc)
+      trace_path = argv[++i];
+    else if (!std::strcmp(argv[i], "--snapshot") && i + 1 < argc)
+      snapshot_path = argv[++i];
+    else
+      images.push_back(argv[i]);
+  }
+  if (images.empty())
+    usage();
+
+  auto vm = std::make_unique<VM>(nullptr, stdout);
+  for (const char *image : images) {
+    if (!vm->read_image(image)) {
+      std::cerr << "failed to load image: " << image << '\n';
+      return 1;
+    }
+  }
+
+  Replayer replayer;
+  string error;
+  if (!replayer.open(log_path, error)) {
+    std::cerr << error << '\n';
+    return 1;
+  }
+  if (!replayer.matches(*vm))
+    std::cerr << "warning: the recording was made from another image\n";
+  vm->replayer = &replayer;
+  until = std::min(until, replayer.recorded_length());
+  vm->set_output_buffering(Flush::Full);
+  vm->start();
+
+  if (trace_path) {
+    std::unique_ptr<std::FILE, decltype(&fclose)> trace(std::fopen(trace_path, "wb"),
+                                                        std::fclose);
+    if (!trace) {
+      std::cerr << "failed to open trace: " << trace_path << '\n';
+      return 1;
+    }
+    TraceWriter writer(trace.get());
+    run_traced(*vm, writer, until);
+  } else {
+    vm->run_for(until - vm->retired);
+  }
+  vm->flush_output();
+
+  if (vm->is_running && vm->retired < replayer.recorded_length()) {
+    std::cerr << "stopped after " << vm->retired << " instructions at x" << std::hex
+              << vm->registers[Registers::R_PC] << std::dec << '\n';
+    if (snapshot_path && !save_snapshot(*vm, snapshot_path)) {
+      std::cerr << "failed to write snapshot: " << snapshot_path << '\n';
+      return 1;
+    }
+    return 0;
+  }
+  if (!replayer.verify(*vm, error)) {
+    std::cerr << "replay diverged: " << error << '\n';
+    return 1;
+  }
+  std::cerr << "replayed " << vm->retired << " instructions\n";
+  return 0;
+}
+
+// translates an image into a native executable, or into C++ with --emit-cpp
+static auto run_aot_mode(int argc, const char *argv[]) -> int {
+  const char *image = nullptr;
+  const char *output = nullptr;
+  bool emit_cpp = false;
+  for (int i = 2; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "-o") && i + 1 < argc)
+      output = argv[++i];
+    else if (!std::strcmp(argv[i], "--emit-cpp"))
+      emit_cpp = true;
+    else
+      image = argv[i];
+  }
+  if (!image || !output)
+    usage();
+
+  return aot_compile(image, output, emit_cpp);
+}
 
 auto main(int argc, const char *argv[]) -> int {
-  if (argc < 2) {
-    cout << "lc3 [image-file] ... \n";
-    exit(2);
+  if (argc < 2)
+    usage();
+
+  if (!std::strcmp(argv[1], "--batch"))
+    return run_batch_mode(argc, argv);
+
+  if (!std::strcmp(argv[1], "--serve"))
+    return run_serve_mode(argc, argv);
+
+  if (!std::strcmp(argv[1], "--snapshot"))
+    return run_snapshot_mode(argc, argv);
+
+  if (!std::strcmp(argv[1], "--replay"))
+    return run_replay_mode(argc, argv);
+
+  if (!std::strcmp(argv[1], "--dump-trace")) {
+    if (argc != 3)
+      usage();
+    if (!dump_trace(argv[2], cout)) {
+      std::cerr << "not a trace: " << argv[2] << '\n';
+      return 1;
+    }
+    return 0;
+  }
+
+  if (!std::strcmp(argv[1], "--aot"))
+    return run_aot_mode(argc, argv);
+
+  Engine engine = Engine::Switch;
+  bool stats = false;
+  bool async_input = false;
+  long idle_wait = 10;
+  bool headless = false;
+  const char *input_path = nullptr;
+  Flush flush = Flush::Always;
+  bool flush_given = false;
+  size_t buffer = 1 << 20;
+  string profile_path, folded_path;
+  const char *record_path = nullptr;
+  const char *os_path = nullptr;
+  const char *metrics_path = nullptr;
+  int first_image = 1;
+  for (; first_image < argc && argv[first_image][0] == '-'; ++first_image) {
+    if (!std::strcmp(argv[first_image], "--engine") && first_image + 1 < argc) {
+      if (!parse_engine(argv[++first_image], engine))
+        usage();
+    } else if (!std::strcmp(argv[first_image], "--stats"))
+      stats = true;
+    else if (!std::strcmp(argv[first_image], "--async-input"))
+      async_input = true;
+    else if (!std::strcmp(argv[first_image], "--idle-wait") && first_image + 1 < argc)
+      idle_wait = std::stol(argv[++first_image]);
+    else if (!std::strcmp(argv[first_image], "--headless"))
+      headless = true;
+    else if (!std::strcmp(argv[first_image], "--input") && first_image + 1 < argc)
+      input_path = argv[++first_image];
+    else if (!std::strcmp(argv[first_image], "--flush") && first_image + 1 < argc) {
+      if (!parse_flush(argv[++first_image], flush))
+        usage();
+      flush_given = true;
+    } else if (!std::strcmp(argv[first_image], "--buffer") && first_image + 1 < argc)
+      buffer = std::stoul(argv[++first_image]);
+    else if (!std::strcmp(argv[first_image], "--profile") && first_image + 1 < argc)
+      profile_path = argv[++first_image];
+    else if (!std::strcmp(argv[first_image], "--folded") && first_image + 1 < argc)
+      folded_path = argv[++first_image];
+    else if (!std::strcmp(argv[first_image], "--record") && first_image + 1 < argc)
+      record_path = argv[++first_image];
+    else if (!std::strcmp(argv[first_image], "--os") && first_image + 1 < argc)
+      os_path = argv[++first_image];
+    else if (!std::strcmp(argv[first_image], "--metrics") && first_image + 1 < argc)
+      metrics_path = argv[++first_image];
+    else
+      usage();
   }
-  for (int i = 1; i < argc; ++i) {
-    if (!read_image(argv[i])) {
+  if (first_image == argc)
+    usage();
+
+  auto vm = std::make_unique<VM>();
+  // the guest's own trap table and service routines replace the built-in ones
+  if (os_path) {
+    if (!vm->read_image(os_path)) {
+      cout << "failed to load image: " << os_path << '\n';
+      exit(1);
+    }
+    vm->set_traps(Traps::Guest);
+  }
+  for (int i = first_image; i < argc; ++i) {
+    if (!vm->read_image(argv[i])) {
       cout << "failed to load image: " << argv[i] << '\n';
       exit(1);
     }
   }
-  signal(SIGINT, handle_interrupt);
-  disable_input_buffering();
+
+  // headless runs never touch the terminal and write output in large chunks
+  std::unique_ptr<std::FILE, decltype(&fclose)> input_file(nullptr, std::fclose);
+  if (input_path) {
+    input_file.reset(std::fopen(input_path, "rb"));
+    if (!input_file) {
+      cout << "failed to open input: " << input_path << '\n';
+      exit(1);
+    }
+    vm->set_io(input_file.get(), stdout);
+  }
+  if (headless && !flush_given)
+    flush = Flush::Full;
+  vm->set_output_buffering(flush, buffer);
+
+  // profiling counts every instruction as the switch engine executes it
+  std::unique_ptr<Profiler> profiler;
+  if (!profile_path.empty() || !folded_path.empty()) {
+    if (engine != Engine::Switch)
+      std::cerr << "profiling runs on the switch engine\n";
+    engine = Engine::Switch;
+    profiler = std::make_unique<Profiler>(profile_path, folded_path);
+    vm->profiler = profiler.get();
+  }
+
+  // recording logs only what the guest reads, so any engine can run
+  std::unique_ptr<std::FILE, decltype(&fclose)> record_file(nullptr, std::fclose);
+  std::unique_ptr<Recorder> recorder;
+  if (record_path) {
+    record_file.reset(std::fopen(record_path, "wb"));
+    if (!record_file) {
+      cout << "failed to open recording: " << record_path << '\n';
+      exit(1);
+    }
+    recorder = std::make_unique<Recorder>(record_file.get(), *vm);
+    vm->recorder = recorder.get();
+  }
+
+  install_interrupt_handler();
+  if (!headless)
+    disable_input_buffering();
+
+  std::unique_ptr<InputQueue> input;
+  if (async_input) {
+    input = std::make_unique<InputQueue>(input_file ? input_file.get() : stdin,
+                                         std::chrono::milliseconds(idle_wait));
+    vm->set_input_queue(input.get());
+  }
+
+  auto metrics = start_metrics(metrics_path);
 
   // std::cout << "VM is running!";
-  run_vm();
+  auto start = std::chrono::steady_clock::now();
+  run(*vm, engine);
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
+  vm->set_input_queue(nullptr);
+  input.reset();
   restore_input_buffering();
+  if (recorder)
+    recorder->finish(*vm);
+
+  if (stats)
+    std::cerr << engine_name(engine) << ": " << vm->retired
+              << " instructions, " << seconds << " s, "
+              << vm->retired / seconds / 1e6 << " MIPS\n";
+  if (stats && engine == Engine::Fused)
+    report_fusions(std::cerr);
+  if (profiler)
+    profiler->write();
+  if (interrupt_requested) {
+    cout << '\n';
+    return -2;
+  }
 }